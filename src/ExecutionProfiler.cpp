@@ -19,13 +19,87 @@
 
 #include "ExecutionProfiler.h"
 
+#include <algorithm>
 #include <cassert>
+#include <cerrno>
+#include <cmath>
 #include <cstring>
+#include <fcntl.h>
+#include <iterator>
+#include <pthread.h>
 #include <sstream>
+#include <sys/stat.h>
+#include <unistd.h>
 
 
 namespace {
 
+/** The columns of the profiling log */
+char const logColumns[] =
+        "Action"
+        ";SectionID"
+        ";ParentSectionID"
+        ";Duration"
+        ";Complexity"
+        #ifdef SHAREMIND_NETWORK_STATISTICS_ENABLE
+        ";NetworkStats[miner,in,out]"
+        #endif
+        ";Attributes"
+        ";ActiveTime"
+        ";SuspendedTime"
+        ";Segments"
+        ";AllocatedBytes"
+        ";Allocations"
+        ";PeakLiveBytes"
+        ";WaitMutex"
+        ";WaitQueue"
+        ";WaitNetwork"
+        ";WaitDisk"
+        ";WaitOther"
+        ";CostModelDeviation";
+
+/**
+ Formats a cost model deviation with three decimals, or as 0 if the section
+ was not flagged, without allocating, so that the log and the emergency file
+ can share the format.
+
+ \returns the number of characters written to the buffer.
+*/
+std::size_t formatCostModelDeviation(double deviation, char (&buffer)[32u])
+        noexcept
+{
+    if (deviation == 0.0 || !std::isfinite(deviation)) {
+        buffer[0u] = '0';
+        return 1u;
+    }
+
+    std::size_t size = 0u;
+    if (deviation < 0.0) {
+        buffer[size++] = '-';
+        deviation = -deviation;
+    }
+
+    std::uint64_t const thousandths =
+            static_cast<std::uint64_t>(std::min(deviation, 1e15) * 1000.0
+                                       + 0.5);
+    char digits[20u];
+    std::size_t i = sizeof(digits);
+    std::uint64_t value = thousandths / 1000u;
+    do {
+        digits[--i] = static_cast<char>('0' + value % 10u);
+        value /= 10u;
+    } while (value > 0u);
+    std::memcpy(buffer + size, digits + i, sizeof(digits) - i);
+    size += sizeof(digits) - i;
+
+    std::uint64_t const fraction = thousandths % 1000u;
+    buffer[size++] = '.';
+    buffer[size++] = static_cast<char>('0' + fraction / 100u);
+    buffer[size++] = static_cast<char>('0' + fraction / 10u % 10u);
+    buffer[size++] = static_cast<char>('0' + fraction % 10u);
+    return size;
+}
+
 #ifdef SHAREMIND_NETWORK_STATISTICS_ENABLE
 inline std::string minerNetworkStatistics(
         sharemind::MinerNetworkStatistics & startStats,
@@ -51,18 +125,194 @@ inline std::string minerNetworkStatistics(
 
     return o.str();
 }
+
+inline bool networkBytes(const sharemind::MinerNetworkStatistics & startStats,
+                         const sharemind::MinerNetworkStatistics & endStats,
+                         std::uint64_t & bytes)
+{
+    if (endStats.empty() || startStats.size() != endStats.size())
+        return false;
+
+    bytes = 0u;
+    for (auto const & start : startStats) {
+        auto const eit(endStats.find(start.first));
+        if (eit == endStats.end())
+            return false;
+        bytes += (eit->second.receivedBytes - start.second.receivedBytes)
+                 + (eit->second.sentBytes - start.second.sentBytes);
+    }
+    return true;
+}
 #endif
 
+/** The profilers with the emergency flush path enabled */
+constexpr std::size_t maxEmergencyProfilers = 16u;
+std::atomic<sharemind::ExecutionProfiler *> emergencyProfilers[maxEmergencyProfilers];
+
+std::once_flag forkHandlersRegistered;
+
+/** The signal actions replaced by installEmergencyFlushSignalHandler */
+std::mutex emergencySignalActionsMutex;
+struct sigaction previousSignalActions[NSIG];
+
+/**
+ The sections tracking allocations at the moment, by the counters of the
+ thread they track, in the order they were started or resumed.
+*/
+std::mutex allocationSegmentsMutex;
+std::map<sharemind::ExecutionAllocationTracker::Counters *,
+         std::vector<sharemind::ExecutionSection *> > allocationSegments;
+
+/** Formats data into a pre-allocated buffer using async-signal-safe calls. */
+class EmergencyWriter {
+
+public: /* Methods: */
+
+    EmergencyWriter(int fd, char * buffer, std::size_t size) noexcept
+        : m_fd(fd)
+        , m_buffer(buffer)
+        , m_size(size)
+    {}
+
+    ~EmergencyWriter() noexcept { flush(); }
+
+    void put(const char * str) noexcept { put(str, std::strlen(str)); }
+
+    void put(const char * data, std::size_t size) noexcept {
+        while (size > 0u) {
+            if (m_used == m_size)
+                flush();
+            std::size_t const n = std::min(size, m_size - m_used);
+            std::memcpy(m_buffer + m_used, data, n);
+            m_used += n;
+            data += n;
+            size -= n;
+        }
+    }
+
+    void put(char c) noexcept { put(&c, 1u); }
+
+    /** Writes the given newline separated records, appending the suffix. */
+    void putRecords(const char * data,
+                    std::size_t size,
+                    const char * suffix) noexcept
+    {
+        while (size > 0u) {
+            char const * const end =
+                    static_cast<char const *>(std::memchr(data, '\n', size));
+            std::size_t const n =
+                    end ? static_cast<std::size_t>(end - data) : size;
+            put(data, n);
+            put(suffix);
+            put('\n');
+            if (!end)
+                break;
+            data += n + 1u;
+            size -= n + 1u;
+        }
+    }
+
+    void put(std::int64_t value) noexcept {
+        if (value < 0) {
+            put('-');
+            put(std::uint64_t(0u) - static_cast<std::uint64_t>(value));
+        } else {
+            put(static_cast<std::uint64_t>(value));
+        }
+    }
+
+    void put(std::uint64_t value) noexcept {
+        char digits[20u];
+        std::size_t i = sizeof(digits);
+        do {
+            digits[--i] = static_cast<char>('0' + value % 10u);
+            value /= 10u;
+        } while (value > 0u);
+        put(digits + i, sizeof(digits) - i);
+    }
+
+    #ifdef SHAREMIND_NETWORK_STATISTICS_ENABLE
+    /** Writes statistics in the format of minerNetworkStatistics. */
+    void putNetworkStatistics(
+            const sharemind::MinerNetworkStatistics & startStats,
+            const sharemind::MinerNetworkStatistics & endStats) noexcept
+    {
+        for (auto const & start : startStats)
+            if (endStats.find(start.first) == endStats.end())
+                return;
+
+        for (auto sit = startStats.begin(); sit != startStats.end(); ++sit) {
+            auto const eit(endStats.find(sit->first));
+            if (sit != startStats.begin())
+                put(',');
+            put('[');
+            put(std::uint64_t(sit->first));
+            put(',');
+            put(std::uint64_t(eit->second.receivedBytes
+                              - sit->second.receivedBytes));
+            put(',');
+            put(std::uint64_t(eit->second.sentBytes - sit->second.sentBytes));
+            put(']');
+        }
+    }
+    #endif
+
+    void flush() noexcept {
+        char const * data = m_buffer;
+        while (m_used > 0u) {
+            ssize_t const r = ::write(m_fd, data, m_used);
+            if (r < 0) {
+                if (errno == EINTR)
+                    continue;
+                break;
+            }
+            data += r;
+            m_used -= static_cast<std::size_t>(r);
+        }
+        m_used = 0u;
+    }
+
+private: /* Fields: */
+
+    int const m_fd;
+    char * const m_buffer;
+    std::size_t const m_size;
+    std::size_t m_used = 0u;
+
+};
+
 }
 
-using std::endl;
 using std::make_pair;
-using std::ofstream;
 using std::string;
 using std::map;
 
 namespace sharemind {
 
+static_assert(ExecutionSection::maxAttributes
+              <= ExecutionSectionRingRecord::maxAttributes,
+              "Shared memory ring records can not hold all attributes!");
+
+static_assert(executionWaitReasonCount
+              == ExecutionSectionRingRecord::waitReasonCount,
+              "Shared memory ring records can not hold all wait reasons!");
+
+constexpr std::size_t ExecutionSection::maxAttributes;
+constexpr std::size_t ExecutionSection::noParentStackPosition;
+constexpr std::size_t ExecutionProfiler::noPeer;
+constexpr std::size_t ExecutionProfiler::maxSectionNameIds;
+
+const char * executionWaitReasonName(ExecutionWaitReason reason) noexcept {
+    switch (reason) {
+        case ExecutionWaitReason::MutexContention: return "Mutex";
+        case ExecutionWaitReason::QueuePop: return "Queue";
+        case ExecutionWaitReason::NetworkReceive: return "Network";
+        case ExecutionWaitReason::Disk: return "Disk";
+        case ExecutionWaitReason::Other: return "Other";
+    }
+    return "Unknown";
+}
+
 ExecutionSection::ExecutionSection(
         const char * sectionName,
         std::uint32_t sectionId_,
@@ -80,12 +330,26 @@ ExecutionSection::ExecutionSection(
     , startTime(startTime_)
     , endTime(endTime_)
     , complexityParameter(complexityParameter_)
+    , suspendedTime(0u)
+    , suspendStartTime(0u)
+    , segmentCount(1u)
+    , suspended(false)
     #ifdef SHAREMIND_NETWORK_STATISTICS_ENABLE
     , startNetworkStatistics(startNetStats)
     , endNetworkStatistics(endNetStats)
     #endif
+    , attributeCount(0u)
+    , allocatedBytes(0u)
+    , allocationCount(0u)
+    , peakLiveBytes(0u)
+    , costModelDeviation(0.0)
     , m_sectionName(sectionName)
     , m_nameCached(false)
+    , m_allocationTracked(false)
+    , m_allocationCounters(nullptr)
+    , m_allocationPeak(0)
+    , m_emergencyFlushed(false)
+    , m_parentStackPosition(noParentStackPosition)
 {
 }
 
@@ -106,16 +370,115 @@ ExecutionSection::ExecutionSection(
     , startTime(startTime_)
     , endTime(endTime_)
     , complexityParameter(complexityParameter_)
+    , suspendedTime(0u)
+    , suspendStartTime(0u)
+    , segmentCount(1u)
+    , suspended(false)
     #ifdef SHAREMIND_NETWORK_STATISTICS_ENABLE
     , startNetworkStatistics(startNetStats)
     , endNetworkStatistics(endNetStats)
     #endif
+    , attributeCount(0u)
+    , allocatedBytes(0u)
+    , allocationCount(0u)
+    , peakLiveBytes(0u)
+    , costModelDeviation(0.0)
     , m_sectionName(sectionType)
     , m_nameCached(true)
+    , m_allocationTracked(false)
+    , m_allocationCounters(nullptr)
+    , m_allocationPeak(0)
+    , m_emergencyFlushed(false)
+    , m_parentStackPosition(noParentStackPosition)
+{
+}
+
+void ExecutionCostModel::add(double complexity, double cost) noexcept {
+    ++count;
+    double const dx = complexity - meanComplexity;
+    meanComplexity += dx / static_cast<double>(count);
+    double const dy = cost - meanCost;
+    meanCost += dy / static_cast<double>(count);
+    complexityM2 += dx * (complexity - meanComplexity);
+    costM2 += dy * (cost - meanCost);
+    comoment += dx * (cost - meanCost);
+}
+
+void ExecutionCostModel::merge(const ExecutionCostModel & other) noexcept {
+    if (other.count == 0u)
+        return;
+
+    if (count == 0u) {
+        *this = other;
+        return;
+    }
+
+    double const n = static_cast<double>(count + other.count);
+    double const w = static_cast<double>(count)
+                     * static_cast<double>(other.count) / n;
+    double const dx = other.meanComplexity - meanComplexity;
+    double const dy = other.meanCost - meanCost;
+
+    meanComplexity += dx * static_cast<double>(other.count) / n;
+    meanCost += dy * static_cast<double>(other.count) / n;
+    complexityM2 += other.complexityM2 + dx * dx * w;
+    costM2 += other.costM2 + dy * dy * w;
+    comoment += other.comoment + dx * dy * w;
+    count += other.count;
+}
+
+double ExecutionCostModel::slope() const noexcept
+{ return complexityM2 > 0.0 ? comoment / complexityM2 : 0.0; }
+
+double ExecutionCostModel::intercept() const noexcept
+{ return meanCost - slope() * meanComplexity; }
+
+double ExecutionCostModel::residualStdDev() const noexcept {
+    if (count < 3u)
+        return 0.0;
+
+    double const sse = complexityM2 > 0.0
+                       ? costM2 - comoment * comoment / complexityM2
+                       : costM2;
+    return sse > 0.0 ? std::sqrt(sse / static_cast<double>(count - 2u)) : 0.0;
+}
+
+void ExecutionSectionTypeStatistics::merge(
+        const ExecutionSectionTypeStatistics & other) noexcept
 {
+    // Waits by peer are recorded while sections are still open:
+    for (auto const & peer : other.networkReceiveWaitsByPeer)
+        networkReceiveWaitsByPeer[peer.first].merge(peer.second);
+
+    if (other.count == 0u)
+        return;
+
+    if (count == 0u || other.minDuration < minDuration)
+        minDuration = other.minDuration;
+    if (other.maxDuration > maxDuration)
+        maxDuration = other.maxDuration;
+
+    count += other.count;
+    totalDuration += other.totalDuration;
+    totalSuspendedTime += other.totalSuspendedTime;
+    totalSegmentCount += other.totalSegmentCount;
+    totalComplexity += other.totalComplexity;
+    totalAllocatedBytes += other.totalAllocatedBytes;
+    totalAllocationCount += other.totalAllocationCount;
+    if (other.maxPeakLiveBytes > maxPeakLiveBytes)
+        maxPeakLiveBytes = other.maxPeakLiveBytes;
+    for (std::size_t i = 0u; i < executionWaitReasonCount; ++i)
+        waits[i].merge(other.waits[i]);
+    durationModel.merge(other.durationModel);
+    #ifdef SHAREMIND_NETWORK_STATISTICS_ENABLE
+    bytesModel.merge(other.bytesModel);
+    #endif
+    outlierCount += other.outlierCount;
 }
 
-bool ExecutionProfiler::startLog(const string & filename) {
+bool ExecutionProfiler::startLog(const string & filename,
+                                 const ExecutionProfilerLogOptions & options)
+{
     assert(!filename.empty());
     m_filename = filename;
 
@@ -123,29 +486,41 @@ bool ExecutionProfiler::startLog(const string & filename) {
     std::lock_guard<std::mutex> lock(m_profileLogMutex);
 
     // Try to open the log file
-    // Note: the file is truncated so that when a script does not have
-    // profiling sections, the old results are not left into the profile log.
-    m_logfile.open(m_filename.c_str(),
-            std::ios_base::out | std::ios_base::trunc);
-
-    if (m_logfile.bad() || m_logfile.fail()) {
+    if (!m_logWriter.open(m_filename, string(logColumns) + '\n', options))
+    {
         m_logger.error() << "Can not open profiler log file '" << m_filename
                          << "'!";
         return false;
     }
 
-    m_logger.debug() << "Opened profiling log file '" << m_filename << "'!";
+    if (!m_ring.isOpen())
+        m_sectionTypeStatistics.clear();
+    m_profilingActive = true;
+    return true;
+}
 
-    m_logfile << "Action"
-                 ";SectionID"
-                 ";ParentSectionID"
-                 ";Duration"
-                 ";Complexity"
-                 #ifdef SHAREMIND_NETWORK_STATISTICS_ENABLE
-                 ";NetworkStats[miner,in,out]"
-                 #endif
-                 << endl;
+bool ExecutionProfiler::startSharedMemoryLog(const string & shmName,
+                                             std::uint32_t capacity,
+                                             std::uint32_t nameCapacity,
+                                             std::uint32_t nameSize)
+{
+    assert(!shmName.empty());
 
+    // Lock the list
+    std::lock_guard<std::mutex> lock(m_profileLogMutex);
+
+    closeSharedMemoryLog();
+    if (!m_ring.open(shmName, capacity, nameCapacity, nameSize)) {
+        m_logger.error() << "Can not open profiler shared memory ring '"
+                         << shmName << "'!";
+        return false;
+    }
+
+    m_ringNameIndices.clear();
+    m_ringAttributeNameIndices.clear();
+    m_ringOverrun = false;
+    if (!m_logWriter.isOpen())
+        m_sectionTypeStatistics.clear();
     m_profilingActive = true;
     return true;
 }
@@ -159,14 +534,25 @@ void ExecutionProfiler::finishLog() {
     processLog_();
 
     // Close the log file, if necessary
-    if (m_logfile.is_open()) {
-        m_logger.debug() << "Closing profiler log file '" << m_filename << "'";
-        m_logfile.close();
-    }
+    m_logWriter.close();
+
+    // Close the shared memory ring, if necessary
+    closeSharedMemoryLog();
 
     m_profilingActive = false;
 }
 
+void ExecutionProfiler::closeSharedMemoryLog() {
+    if (!m_ring.isOpen())
+        return;
+
+    std::uint64_t const dropped = m_ring.droppedRecords();
+    if (dropped > 0u)
+        m_logger.warning() << "Dropped " << dropped << " sections due to "
+                              "shared memory ring overruns.";
+    m_ring.close();
+}
+
 void ExecutionProfiler::processLog() {
     if (!m_profilingActive)
         return;
@@ -181,6 +567,8 @@ void ExecutionProfiler::processLog_() {
     // Write all sections to the disc
     while (m_sections.size() > 0)
         processLogStep();
+    if (m_logWriter.isOpen())
+        m_logWriter.flush();
 }
 
 void ExecutionProfiler::processLog(std::uint32_t timeLimitMs) {
@@ -196,27 +584,378 @@ void ExecutionProfiler::processLog_(std::uint32_t timeLimitMs) {
     const UsTime end = getUsTime() + timeLimitMs * 1000u;
     while (getUsTime() < end && m_sections.size() > 0u)
         processLogStep();
+    if (m_logWriter.isOpen())
+        m_logWriter.flush();
 }
 
 void ExecutionProfiler::processLogStep() {
     ExecutionSection * const s = m_sections.front();
 
-    m_logfile << getSectionName(s) << ";"
-              << s->sectionId << ";"
-              << s->parentSectionId << ";"
-              << (s->endTime - s->startTime) << ";"
-              << s->complexityParameter
-              #ifdef SHAREMIND_NETWORK_STATISTICS_ENABLE
-              << ";" << minerNetworkStatistics(
-                            s->startNetworkStatistics,
-                            s->endNetworkStatistics)
-              #endif
-              << endl;
+    if (m_ring.isOpen())
+        publishSection(*s);
+
+    // Sections written to the emergency file are not written again:
+    if (m_logWriter.isOpen() && !s->m_emergencyFlushed) {
+        std::ostream & o = m_logWriter.stream();
+        o << getSectionName(s) << ";"
+          << s->sectionId << ";"
+          << s->parentSectionId << ";"
+          << (s->endTime - s->startTime) << ";"
+          << s->complexityParameter
+          #ifdef SHAREMIND_NETWORK_STATISTICS_ENABLE
+          << ";" << minerNetworkStatistics(
+                        s->startNetworkStatistics,
+                        s->endNetworkStatistics)
+          #endif
+          << ";";
+        for (std::size_t i = 0u; i < s->attributeCount; ++i) {
+            ExecutionSectionAttribute const & a = s->attributes[i];
+            o << (i == 0u ? "" : ",") << getAttributeString(a.key) << '=';
+            if (a.type == ExecutionSectionAttribute::Type::String) {
+                o << getAttributeString(static_cast<std::uint32_t>(a.value));
+            } else {
+                o << a.value;
+            }
+        }
+        o << ';' << s->activeTime()
+          << ';' << s->suspendedTime
+          << ';' << s->segmentCount
+          << ';' << s->allocatedBytes
+          << ';' << s->allocationCount
+          << ';' << s->peakLiveBytes;
+        for (ExecutionWaitStatistics const & wait : s->waits)
+            o << ';' << wait.totalTime;
+        char deviation[32u];
+        o << ';';
+        o.write(deviation,
+                static_cast<std::streamsize>(
+                    formatCostModelDeviation(s->costModelDeviation,
+                                             deviation)));
+        o << '\n';
+        m_logWriter.endRecord();
+    }
 
     delete s;
     m_sections.pop_front();
 }
 
+void ExecutionProfiler::publishSection(const ExecutionSection & s) {
+    SectionTypeKey const key(getSectionTypeKey(s));
+    auto it(m_ringNameIndices.find(key));
+    if (it == m_ringNameIndices.end())
+        it = m_ringNameIndices.insert(
+                 make_pair(key, m_ring.addName(getSectionTypeName(key)))).first;
+
+    ExecutionSectionRingRecord record;
+    record.sectionId = s.sectionId;
+    record.parentSectionId = s.parentSectionId;
+    record.nameIndex = it->second;
+    record.attributeCount = static_cast<std::uint32_t>(s.attributeCount);
+    record.startTime = s.startTime;
+    record.endTime = s.endTime;
+    record.complexityParameter = s.complexityParameter;
+    record.suspendedTime = s.suspendedTime;
+    record.segmentCount = s.segmentCount;
+    record.reserved = 0u;
+    record.allocatedBytes = s.allocatedBytes;
+    record.allocationCount = s.allocationCount;
+    record.peakLiveBytes = s.peakLiveBytes;
+    record.costModelDeviation = s.costModelDeviation;
+    for (std::size_t i = 0u; i < executionWaitReasonCount; ++i) {
+        record.waits[i].count = s.waits[i].count;
+        record.waits[i].totalTime = s.waits[i].totalTime;
+    }
+    for (std::size_t i = 0u; i < s.attributeCount; ++i) {
+        ExecutionSectionAttribute const & a = s.attributes[i];
+        ExecutionSectionRingAttribute & ra = record.attributes[i];
+        ra.keyIndex = getRingAttributeNameIndex(a.key);
+        if (a.type == ExecutionSectionAttribute::Type::String) {
+            ra.isString = 1u;
+            ra.value = getRingAttributeNameIndex(
+                           static_cast<std::uint32_t>(a.value));
+        } else {
+            ra.isString = 0u;
+            ra.value = a.value;
+        }
+    }
+
+    if (m_ring.publish(record)) {
+        m_ringOverrun = false;
+    } else if (!m_ringOverrun) {
+        m_logger.warning() << "Shared memory ring is full, dropping sections.";
+        m_ringOverrun = true;
+    }
+}
+
+bool ExecutionProfiler::enableEmergencyFlush(const string & filename,
+                                             std::size_t bufferSize)
+{
+    assert(!filename.empty());
+    assert(bufferSize > 0u);
+
+    disableEmergencyFlush();
+
+    std::call_once(forkHandlersRegistered, []() {
+        ::pthread_atfork(&ExecutionProfiler::prepareForkHandler,
+                         &ExecutionProfiler::parentForkHandler,
+                         &ExecutionProfiler::childForkHandler);
+    });
+
+    m_emergencyBuffer.reset(new char[bufferSize]);
+    m_emergencyBufferSize = bufferSize;
+    m_emergencyFlushed = false;
+    m_emergencyFd = ::open(filename.c_str(),
+                           O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                           S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (m_emergencyFd < 0) {
+        m_logger.error() << "Can not open profiler emergency file '"
+                         << filename << "': " << std::strerror(errno);
+        m_emergencyBuffer.reset();
+        return false;
+    }
+
+    for (auto & slot : emergencyProfilers) {
+        ExecutionProfiler * expected = nullptr;
+        if (slot.compare_exchange_strong(expected, this)) {
+            m_logger.debug() << "Enabled emergency flushing to '" << filename
+                             << "'.";
+            return true;
+        }
+    }
+
+    m_logger.error() << "Too many profilers with emergency flushing enabled!";
+    ::close(m_emergencyFd);
+    m_emergencyFd = -1;
+    m_emergencyBuffer.reset();
+    return false;
+}
+
+void ExecutionProfiler::disableEmergencyFlush() noexcept {
+    if (m_emergencyFd < 0)
+        return;
+
+    for (auto & slot : emergencyProfilers) {
+        ExecutionProfiler * expected = this;
+        if (slot.compare_exchange_strong(expected, nullptr))
+            break;
+    }
+
+    ::close(m_emergencyFd);
+    m_emergencyFd = -1;
+    m_emergencyBuffer.reset();
+    m_emergencyBufferSize = 0u;
+}
+
+void ExecutionProfiler::emergencyFlush() noexcept {
+    if (m_emergencyFd < 0 || m_emergencyFlushed.exchange(true))
+        return;
+
+    EmergencyWriter w(m_emergencyFd,
+                      m_emergencyBuffer.get(),
+                      m_emergencyBufferSize);
+    UsTime const now = getUsTime();
+
+    // The columns of the log followed by the state of the section:
+    w.put(logColumns);
+    w.put(";State\n");
+
+    // Records already formatted for the log belong there, unless the log is
+    // compressed or being written to:
+    m_logWriter.emergencyFlush(
+                [&w](const char * data, std::size_t size) noexcept
+                { w.putRecords(data, size, ";completed"); });
+
+    auto const writeSection =
+            [this, &w](const ExecutionSection & s,
+                       UsTime endTime,
+                       UsTime suspendedTime,
+                       const char * state)
+            {
+                UsTime const duration =
+                        endTime > s.startTime ? endTime - s.startTime : 0u;
+                w.put(getSectionName(&s));
+                w.put(';');
+                w.put(std::uint64_t(s.sectionId));
+                w.put(';');
+                w.put(std::uint64_t(s.parentSectionId));
+                w.put(';');
+                w.put(std::uint64_t(duration));
+                w.put(';');
+                w.put(std::uint64_t(s.complexityParameter));
+                w.put(';');
+                #ifdef SHAREMIND_NETWORK_STATISTICS_ENABLE
+                w.putNetworkStatistics(s.startNetworkStatistics,
+                                       s.endNetworkStatistics);
+                w.put(';');
+                #endif
+                for (std::size_t i = 0u; i < s.attributeCount; ++i) {
+                    ExecutionSectionAttribute const & a = s.attributes[i];
+                    if (i != 0u)
+                        w.put(',');
+                    w.put(getAttributeString(a.key));
+                    w.put('=');
+                    if (a.type == ExecutionSectionAttribute::Type::String) {
+                        w.put(getAttributeString(
+                                  static_cast<std::uint32_t>(a.value)));
+                    } else {
+                        w.put(a.value);
+                    }
+                }
+                w.put(';');
+                w.put(std::uint64_t(duration > suspendedTime
+                                    ? duration - suspendedTime
+                                    : 0u));
+                w.put(';');
+                w.put(std::uint64_t(suspendedTime));
+                w.put(';');
+                w.put(std::uint64_t(s.segmentCount));
+                w.put(';');
+                w.put(s.allocatedBytes);
+                w.put(';');
+                w.put(s.allocationCount);
+                w.put(';');
+                w.put(s.peakLiveBytes);
+                w.put(';');
+                for (ExecutionWaitStatistics const & wait : s.waits) {
+                    w.put(wait.totalTime);
+                    w.put(';');
+                }
+                char deviation[32u];
+                w.put(deviation,
+                      formatCostModelDeviation(s.costModelDeviation,
+                                               deviation));
+                w.put(';');
+                w.put(state);
+                w.put('\n');
+            };
+
+    for (ExecutionSection * const s : m_sections) {
+        writeSection(*s, s->endTime, s->suspendedTime, "completed");
+        s->m_emergencyFlushed = true;
+    }
+
+    for (auto const & section : m_sectionMap) {
+        ExecutionSection const & s = *section.second;
+        UsTime suspendedTime = s.suspendedTime;
+        if (s.suspended && now > s.suspendStartTime)
+            suspendedTime += now - s.suspendStartTime;
+        writeSection(s, now, suspendedTime, s.suspended ? "suspended" : "open");
+    }
+}
+
+bool ExecutionProfiler::installEmergencyFlushSignalHandler(int signalNumber) {
+    assert(signalNumber > 0 && signalNumber < NSIG);
+
+    std::lock_guard<std::mutex> lock(emergencySignalActionsMutex);
+
+    struct sigaction action;
+    std::memset(&action, 0, sizeof(action));
+    action.sa_sigaction = &ExecutionProfiler::emergencySignalHandler;
+    action.sa_flags = SA_SIGINFO | SA_ONSTACK;
+    ::sigemptyset(&action.sa_mask);
+
+    struct sigaction previous;
+    if (::sigaction(signalNumber, &action, &previous) != 0)
+        return false;
+
+    // Do not chain to ourselves when installed twice:
+    if (!(previous.sa_flags & SA_SIGINFO)
+        || previous.sa_sigaction != &ExecutionProfiler::emergencySignalHandler)
+        previousSignalActions[signalNumber] = previous;
+    return true;
+}
+
+void ExecutionProfiler::emergencySignalHandler(int signalNumber,
+                                               siginfo_t * info,
+                                               void * context)
+{
+    int const savedErrno = errno;
+
+    for (auto & slot : emergencyProfilers)
+        if (ExecutionProfiler * const profiler = slot.load())
+            profiler->emergencyFlush();
+
+    struct sigaction const & previous = previousSignalActions[signalNumber];
+    if (previous.sa_flags & SA_SIGINFO) {
+        previous.sa_sigaction(signalNumber, info, context);
+    } else if (previous.sa_handler == SIG_DFL) {
+        // The signal is delivered again with its default action once we
+        // return, since it is blocked while we are handling it:
+        ::sigaction(signalNumber, &previous, nullptr);
+        ::raise(signalNumber);
+    } else if (previous.sa_handler != SIG_IGN) {
+        previous.sa_handler(signalNumber);
+    }
+
+    errno = savedErrno;
+}
+
+void ExecutionProfiler::prepareForkHandler() noexcept {
+    for (auto & slot : emergencyProfilers)
+        if (ExecutionProfiler * const profiler = slot.load()) {
+            profiler->m_profileLogMutex.lock();
+            profiler->m_logWriter.prepareFork();
+        }
+    allocationSegmentsMutex.lock();
+}
+
+void ExecutionProfiler::parentForkHandler() noexcept {
+    allocationSegmentsMutex.unlock();
+    for (auto & slot : emergencyProfilers)
+        if (ExecutionProfiler * const profiler = slot.load()) {
+            profiler->m_logWriter.parentAfterFork();
+            profiler->m_profileLogMutex.unlock();
+        }
+}
+
+void ExecutionProfiler::childForkHandler() noexcept {
+    allocationSegmentsMutex.unlock();
+    for (auto & slot : emergencyProfilers) {
+        if (ExecutionProfiler * const profiler = slot.load()) {
+            profiler->resetAfterFork();
+            profiler->m_profileLogMutex.unlock();
+        }
+    }
+}
+
+void ExecutionProfiler::resetAfterFork() noexcept {
+    // The sections belong to the parent, which also writes them:
+    for (ExecutionSection * const s : m_sections)
+        delete s;
+    m_sections.clear();
+    for (auto const & section : m_sectionMap) {
+        if (section.second->m_allocationCounters)
+            endAllocationSegment(*section.second);
+        delete section.second;
+    }
+    m_sectionMap.clear();
+    m_parentSectionStack.clear();
+    m_sectionTypeStatistics.clear();
+
+    m_logWriter.resetAfterFork();
+    m_ring.resetAfterFork();
+    m_ringNameIndices.clear();
+    m_ringAttributeNameIndices.clear();
+    m_profilingActive = false;
+
+    disableEmergencyFlush();
+}
+
+std::uint32_t ExecutionProfiler::getRingAttributeNameIndex(
+        std::uint32_t attributeStringId)
+{
+    if (attributeStringId >= m_ringAttributeNameIndices.size())
+        m_ringAttributeNameIndices.resize(m_attributeStrings.size(),
+                                          ExecutionSectionRing::noNameIndex);
+    if (attributeStringId >= m_ringAttributeNameIndices.size())
+        return ExecutionSectionRing::noNameIndex;
+
+    std::uint32_t & index = m_ringAttributeNameIndices[attributeStringId];
+    if (index == ExecutionSectionRing::noNameIndex)
+        index = m_ring.addName(getAttributeString(attributeStringId));
+    return index;
+}
+
 std::uint32_t ExecutionProfiler::newSectionType(const char * name) {
     assert(name);
 
@@ -242,6 +981,103 @@ std::uint32_t ExecutionProfiler::newSectionType(const char * name) {
     return m_nextSectionTypeId++;
 }
 
+std::uint32_t ExecutionProfiler::newAttributeKey(const char * name) {
+    assert(name);
+
+    // Lock the list
+    std::lock_guard<std::mutex> lock(m_profileLogMutex);
+    return internAttributeString(name);
+}
+
+std::uint32_t ExecutionProfiler::newAttributeValue(const char * value) {
+    assert(value);
+
+    // Lock the list
+    std::lock_guard<std::mutex> lock(m_profileLogMutex);
+    return internAttributeString(value);
+}
+
+std::uint32_t ExecutionProfiler::internSectionName(const char * name) {
+    auto const it(m_sectionNameIds.find(name));
+    if (it != m_sectionNameIds.end()
+        && std::strcmp(getAttributeString(it->second), name) == 0)
+        return it->second;
+
+    // Names built at runtime may each have a different pointer:
+    if (m_sectionNameIds.size() >= maxSectionNameIds)
+        m_sectionNameIds.clear();
+
+    std::uint32_t const id = internAttributeString(name);
+    m_sectionNameIds[name] = id;
+    return id;
+}
+
+std::uint32_t ExecutionProfiler::internAttributeString(const char * str) {
+    auto const r(m_attributeStringIds.insert(
+                     make_pair(string(str),
+                               static_cast<std::uint32_t>(
+                                   m_attributeStrings.size()))));
+    if (r.second)
+        m_attributeStrings.push_back(r.first->first.c_str());
+    return r.first->second;
+}
+
+bool ExecutionProfiler::setSectionAttribute(std::uint32_t sectionId,
+                                            std::uint32_t key,
+                                            std::int64_t value)
+{
+    if (!m_profilingActive)
+        return false;
+
+    return setSectionAttribute_(
+                sectionId,
+                ExecutionSectionAttribute::integer(key, value));
+}
+
+bool ExecutionProfiler::setSectionStringAttribute(std::uint32_t sectionId,
+                                                  std::uint32_t key,
+                                                  std::uint32_t value)
+{
+    if (!m_profilingActive)
+        return false;
+
+    return setSectionAttribute_(
+                sectionId,
+                ExecutionSectionAttribute::string(key, value));
+}
+
+bool ExecutionProfiler::setSectionAttribute_(
+        std::uint32_t sectionId,
+        const ExecutionSectionAttribute & attribute)
+{
+    // Lock the list
+    std::lock_guard<std::mutex> lock(m_profileLogMutex);
+
+    auto const it(m_sectionMap.find(sectionId));
+    if (it == m_sectionMap.end())
+        return false;
+
+    return applySectionAttribute(*it->second, attribute);
+}
+
+bool ExecutionProfiler::applySectionAttribute(
+        ExecutionSection & s,
+        const ExecutionSectionAttribute & attribute) noexcept
+{
+    for (std::size_t i = 0u; i < s.attributeCount; ++i) {
+        if (s.attributes[i].key == attribute.key) {
+            s.attributes[i] = attribute;
+            return true;
+        }
+    }
+
+    if (s.attributeCount >= ExecutionSection::maxAttributes)
+        return false;
+
+    s.attributes[s.attributeCount++] = attribute;
+    return true;
+}
+
 void ExecutionProfiler::endSection(std::uint32_t sectionId) {
     if (!m_profilingActive)
         return;
@@ -254,6 +1090,22 @@ void ExecutionProfiler::endSection(std::uint32_t sectionId) {
                );
 }
 
+void ExecutionProfiler::endSection(
+        std::uint32_t sectionId,
+        std::initializer_list<ExecutionSectionAttribute> attributes)
+{
+    if (!m_profilingActive)
+        return;
+
+    endSection_(sectionId,
+                getUsTime(),
+                #ifdef SHAREMIND_NETWORK_STATISTICS_ENABLE
+                MinerNetworkStatistics(),
+                #endif
+                attributes.begin(),
+                attributes.size());
+}
+
 void ExecutionProfiler::endSection(
         std::uint32_t sectionId,
         const UsTime endTime
@@ -265,6 +1117,24 @@ void ExecutionProfiler::endSection(
     if (!m_profilingActive)
         return;
 
+    endSection_(sectionId,
+                endTime,
+                #ifdef SHAREMIND_NETWORK_STATISTICS_ENABLE
+                endNetStats,
+                #endif
+                nullptr,
+                0u);
+}
+
+void ExecutionProfiler::endSection_(
+        std::uint32_t sectionId,
+        const UsTime endTime,
+        #ifdef SHAREMIND_NETWORK_STATISTICS_ENABLE
+        const MinerNetworkStatistics & endNetStats,
+        #endif
+        const ExecutionSectionAttribute * attributes,
+        std::size_t attributeCount)
+{
     // Lock the list
     std::lock_guard<std::mutex> lock(m_profileLogMutex);
 
@@ -275,21 +1145,265 @@ void ExecutionProfiler::endSection(
         return;
     }
 
+    for (std::size_t i = 0u; i < attributeCount; ++i)
+        applySectionAttribute(*it->second, attributes[i]);
+
     it->second->endTime = endTime;
+    if (it->second->m_allocationCounters)
+        endAllocationSegment(*it->second);
+    if (it->second->suspended) {
+        if (endTime > it->second->suspendStartTime)
+            it->second->suspendedTime += endTime - it->second->suspendStartTime;
+        it->second->suspended = false;
+    }
     #ifdef SHAREMIND_NETWORK_STATISTICS_ENABLE
     it->second->endNetworkStatistics = endNetStats;
     #endif
+    updateSectionTypeStatistics(*it->second);
     m_sections.push_back(it->second);
     m_sectionMap.erase(it);
 }
 
+void ExecutionProfiler::startAllocationSegment(ExecutionSection & s) {
+    ExecutionAllocationTracker::Counters & c =
+            ExecutionAllocationTracker::counters();
+
+    std::lock_guard<std::mutex> lock(allocationSegmentsMutex);
+    std::vector<ExecutionSection *> & segments = allocationSegments[&c];
+
+    // The peak so far belongs to the sections already tracking this thread,
+    // since the peak is tracked separately for the new section from now on:
+    if (!segments.empty()
+        && c.peakLiveBytes > segments.back()->m_allocationPeak)
+        segments.back()->m_allocationPeak = c.peakLiveBytes;
+
+    segments.push_back(&s);
+    s.m_allocationCounters = &c;
+    s.m_allocationStart = c;
+    s.m_allocationPeak = c.liveBytes;
+    c.peakLiveBytes = c.liveBytes;
+}
+
+void ExecutionProfiler::endAllocationSegment(ExecutionSection & s) noexcept {
+    ExecutionAllocationTracker::Counters & c =
+            ExecutionAllocationTracker::counters();
+
+    std::lock_guard<std::mutex> lock(allocationSegmentsMutex);
+    auto const it(allocationSegments.find(s.m_allocationCounters));
+    assert(it != allocationSegments.end());
+    std::vector<ExecutionSection *> & segments = it->second;
+    auto const pos(std::find(segments.begin(), segments.end(), &s));
+    assert(pos != segments.end());
+
+    // Allocations of other threads can not be attributed to the section:
+    if (s.m_allocationCounters == &c) {
+        // The sections started later on this thread hold the peaks since:
+        std::int64_t peak = std::max(s.m_allocationPeak, c.peakLiveBytes);
+        for (auto later = std::next(pos); later != segments.end(); ++later)
+            peak = std::max(peak, (*later)->m_allocationPeak);
+
+        ExecutionAllocationTracker::Counters const & start =
+                s.m_allocationStart;
+        s.allocatedBytes += c.allocatedBytes - start.allocatedBytes;
+        s.allocationCount += c.allocationCount - start.allocationCount;
+        if (peak > start.liveBytes)
+            s.peakLiveBytes =
+                    std::max(s.peakLiveBytes,
+                             static_cast<std::uint64_t>(
+                                 peak - start.liveBytes));
+    }
+
+    // The peak of this section is part of the peaks of the sections started
+    // before it on this thread:
+    if (pos != segments.begin()
+        && s.m_allocationPeak > (*std::prev(pos))->m_allocationPeak)
+        (*std::prev(pos))->m_allocationPeak = s.m_allocationPeak;
+
+    segments.erase(pos);
+    if (segments.empty())
+        allocationSegments.erase(it);
+    s.m_allocationCounters = nullptr;
+}
+
+void ExecutionProfiler::recordWait(std::uint32_t sectionId,
+                                   ExecutionWaitReason reason,
+                                   UsTime startTime,
+                                   UsTime endTime,
+                                   std::size_t peer)
+{
+    assert(static_cast<std::size_t>(reason) < executionWaitReasonCount);
+
+    if (!m_profilingActive || sectionId == 0u)
+        return;
+
+    UsTime const duration = endTime > startTime ? endTime - startTime : 0u;
+
+    // Lock the list
+    std::lock_guard<std::mutex> lock(m_profileLogMutex);
+
+    auto const it(m_sectionMap.find(sectionId));
+    if (it == m_sectionMap.end())
+        return;
+
+    ExecutionSection & s = *it->second;
+    s.waits[static_cast<std::size_t>(reason)].add(duration);
+
+    if (reason == ExecutionWaitReason::NetworkReceive && peer != noPeer)
+        m_sectionTypeStatistics[getSectionTypeKey(s)]
+                .networkReceiveWaitsByPeer[peer].add(duration);
+}
+
+void ExecutionProfiler::suspendSection(std::uint32_t sectionId,
+                                       bool removeFromParentStack)
+{
+    if (!m_profilingActive)
+        return;
+
+    UsTime const now = getUsTime();
+
+    // Lock the list
+    std::lock_guard<std::mutex> lock(m_profileLogMutex);
+
+    auto const it(m_sectionMap.find(sectionId));
+    if (it == m_sectionMap.end()) {
+        m_logger.error() << "Could not suspend section " << sectionId
+                         << ". Not in queue.";
+        return;
+    }
+
+    ExecutionSection & s = *it->second;
+    if (s.suspended)
+        return;
+
+    s.suspended = true;
+    s.suspendStartTime = now;
+    if (s.m_allocationCounters)
+        endAllocationSegment(s);
+
+    if (removeFromParentStack) {
+        // Remove the innermost entry of the section, which need not be on top:
+        auto const pos(std::find(m_parentSectionStack.rbegin(),
+                                 m_parentSectionStack.rend(),
+                                 sectionId));
+        if (pos != m_parentSectionStack.rend()) {
+            s.m_parentStackPosition =
+                    static_cast<std::size_t>(
+                        m_parentSectionStack.rend() - pos - 1);
+            m_parentSectionStack.erase(std::next(pos).base());
+        }
+    }
+}
+
+void ExecutionProfiler::resumeSection(std::uint32_t sectionId) {
+    if (!m_profilingActive)
+        return;
+
+    UsTime const now = getUsTime();
+
+    // Lock the list
+    std::lock_guard<std::mutex> lock(m_profileLogMutex);
+
+    auto const it(m_sectionMap.find(sectionId));
+    if (it == m_sectionMap.end()) {
+        m_logger.error() << "Could not resume section " << sectionId
+                         << ". Not in queue.";
+        return;
+    }
+
+    ExecutionSection & s = *it->second;
+    if (!s.suspended)
+        return;
+
+    if (now > s.suspendStartTime)
+        s.suspendedTime += now - s.suspendStartTime;
+    s.suspended = false;
+    ++s.segmentCount;
+    if (s.m_allocationTracked)
+        startAllocationSegment(s);
+
+    if (s.m_parentStackPosition != ExecutionSection::noParentStackPosition) {
+        std::size_t const pos = std::min(s.m_parentStackPosition,
+                                         m_parentSectionStack.size());
+        m_parentSectionStack.insert(
+                    m_parentSectionStack.begin()
+                    + static_cast<std::ptrdiff_t>(pos),
+                    sectionId);
+        s.m_parentStackPosition = ExecutionSection::noParentStackPosition;
+    }
+}
+
+void ExecutionProfiler::updateSectionTypeStatistics(ExecutionSection & s) {
+    UsTime const duration = s.endTime - s.startTime;
+    UsTime const activeTime = s.activeTime();
+    ExecutionSectionTypeStatistics & stats =
+            m_sectionTypeStatistics[getSectionTypeKey(s)];
+
+    if (stats.count == 0u || duration < stats.minDuration)
+        stats.minDuration = duration;
+    if (duration > stats.maxDuration)
+        stats.maxDuration = duration;
+
+    ++stats.count;
+    stats.totalDuration += duration;
+    stats.totalSuspendedTime += s.suspendedTime;
+    stats.totalSegmentCount += s.segmentCount;
+    stats.totalComplexity += s.complexityParameter;
+    stats.totalAllocatedBytes += s.allocatedBytes;
+    stats.totalAllocationCount += s.allocationCount;
+    if (s.peakLiveBytes > stats.maxPeakLiveBytes)
+        stats.maxPeakLiveBytes = s.peakLiveBytes;
+    for (std::size_t i = 0u; i < executionWaitReasonCount; ++i)
+        stats.waits[i].merge(s.waits[i]);
+
+    double const complexity = static_cast<double>(s.complexityParameter);
+    if (m_costModelOutlierThreshold > 0.0
+        && stats.durationModel.count >= m_costModelMinSamples)
+    {
+        double const stdDev = stats.durationModel.residualStdDev();
+        if (stdDev > 0.0) {
+            double const deviation =
+                    (static_cast<double>(activeTime)
+                     - stats.durationModel.predict(complexity)) / stdDev;
+            if (std::fabs(deviation) > m_costModelOutlierThreshold) {
+                s.costModelDeviation = deviation;
+                ++stats.outlierCount;
+            }
+        }
+    }
+    stats.durationModel.add(complexity, static_cast<double>(activeTime));
+
+    #ifdef SHAREMIND_NETWORK_STATISTICS_ENABLE
+    std::uint64_t bytes;
+    if (networkBytes(s.startNetworkStatistics, s.endNetworkStatistics, bytes))
+        stats.bytesModel.add(complexity, static_cast<double>(bytes));
+    #endif
+}
+
+void ExecutionProfiler::setAllocationTracking(bool enabled) {
+    // Lock the list
+    std::lock_guard<std::mutex> lock(m_profileLogMutex);
+    m_allocationTracking = enabled;
+}
+
+void ExecutionProfiler::setCostModelOutlierThreshold(double threshold,
+                                                     std::uint64_t minSamples)
+{
+    assert(threshold >= 0.0);
+    assert(minSamples >= 3u);
+
+    // Lock the list
+    std::lock_guard<std::mutex> lock(m_profileLogMutex);
+    m_costModelOutlierThreshold = threshold;
+    m_costModelMinSamples = minSamples;
+}
+
 void ExecutionProfiler::pushParentSection(std::uint32_t sectionId) {
     if (!m_profilingActive)
         return;
 
     // Lock the list
     std::lock_guard<std::mutex> lock(m_profileLogMutex);
-    m_parentSectionStack.push(sectionId);
+    m_parentSectionStack.push_back(sectionId);
 }
 
 void ExecutionProfiler::popParentSection() {
@@ -300,7 +1414,73 @@ void ExecutionProfiler::popParentSection() {
     std::lock_guard<std::mutex> lock(m_profileLogMutex);
 
     if (!m_parentSectionStack.empty())
-        m_parentSectionStack.pop();
+        m_parentSectionStack.pop_back();
+}
+
+ExecutionProfilerSnapshot ExecutionProfiler::snapshot() {
+    struct OpenSection {
+        const char * name;
+        std::uint32_t sectionId;
+        std::uint32_t parentSectionId;
+        std::size_t complexityParameter;
+        UsTime startTime;
+        UsTime suspendedTime;
+        UsTime suspendStartTime;
+        bool suspended;
+    };
+
+    ExecutionProfilerSnapshot r;
+    std::vector<std::pair<const char *, ExecutionSectionTypeStatistics> > types;
+    std::vector<OpenSection> openSections;
+
+    {
+        // Only copy the state while holding the lock. Section type names are
+        // cached or interned, hence they remain valid after releasing the
+        // lock.
+        std::lock_guard<std::mutex> lock(m_profileLogMutex);
+
+        r.time = getUsTime();
+        r.pendingSections = m_sections.size();
+
+        types.reserve(m_sectionTypeStatistics.size());
+        for (auto const & stats : m_sectionTypeStatistics)
+            types.emplace_back(getSectionTypeName(stats.first), stats.second);
+
+        openSections.reserve(m_sectionMap.size());
+        for (auto const & section : m_sectionMap) {
+            ExecutionSection const * const s = section.second;
+            openSections.push_back(
+                        OpenSection{getSectionTypeName(getSectionTypeKey(*s)),
+                                    s->sectionId,
+                                    s->parentSectionId,
+                                    s->complexityParameter,
+                                    s->startTime,
+                                    s->suspendedTime,
+                                    s->suspendStartTime,
+                                    s->suspended});
+        }
+    }
+
+    // Several uncached section types may share a name:
+    for (auto const & type : types)
+        r.sectionTypeStatistics[type.first].merge(type.second);
+
+    r.openSections.reserve(openSections.size());
+    for (OpenSection const & s : openSections)
+        r.openSections.push_back(
+                    ExecutionProfilerSnapshot::OpenSection{
+                        s.name,
+                        s.sectionId,
+                        s.parentSectionId,
+                        s.complexityParameter,
+                        s.startTime <= r.time ? r.time - s.startTime : 0u,
+                        s.suspendedTime
+                        + (s.suspended && s.suspendStartTime <= r.time
+                           ? r.time - s.suspendStartTime
+                           : 0u),
+                        s.suspended});
+
+    return r;
 }
 
 } // namespace sharemind {
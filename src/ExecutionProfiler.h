@@ -20,17 +20,24 @@
 #ifndef SHAREMIND_EXECUTIONPROFILER_H
 #define SHAREMIND_EXECUTIONPROFILER_H
 
+#include <array>
+#include <atomic>
 #include <cstddef>
 #include <cstdint>
 #include <deque>
-#include <fstream>
+#include <initializer_list>
 #include <LogHard/Logger.h>
 #include <map>
+#include <memory>
 #include <mutex>
+#include <signal.h>
 #include <sharemind/MicrosecondTime.h>
-#include <stack>
 #include <string>
+#include <unordered_map>
 #include <utility>
+#include <vector>
+#include "ExecutionProfilerLogWriter.h"
+#include "ExecutionSectionRing.h"
 
 
 namespace sharemind {
@@ -54,6 +61,10 @@ class ExecutionProfiler;
         (profiler).pushParentSection((sid));
     #define POP_PARENT_SECTION(profiler)\
         (profiler).popParentSection();
+    #define SUSPEND_SECTION(profiler, sid)\
+        (profiler).suspendSection((sid));
+    #define RESUME_SECTION(profiler, sid)\
+        (profiler).resumeSection((sid));
     #define PROCESS_SECTIONS(profiler, timeMs)\
         (profiler).processLog((timeMs));
 #else
@@ -62,6 +73,8 @@ class ExecutionProfiler;
     #define SCOPED_SECTION(profiler, sid, type, parameter)
     #define PUSH_PARENT_SECTION(profiler, sid)
     #define POP_PARENT_SECTION(profiler)
+    #define SUSPEND_SECTION(profiler, sid)
+    #define RESUME_SECTION(profiler, sid)
     #define PROCESS_SECTIONS(profiler, timeMs)
 #endif
 
@@ -116,6 +129,151 @@ struct NetworkStats {
 typedef std::map<std::size_t, NetworkStats> MinerNetworkStatistics;
 #endif
 
+/**
+ Thread-local memory allocation counters for attributing allocations to
+ execution sections.
+
+ The host allocator, or a replacement of the global operator new and operator
+ delete, reports allocations and deallocations of the current thread using
+ recordAllocation and recordDeallocation. When allocation tracking is enabled
+ with ExecutionProfiler::setAllocationTracking, sections record the
+ allocations made by the thread between starting and ending them.
+*/
+class ExecutionAllocationTracker {
+
+public: /* Types: */
+
+    struct Counters {
+
+        /** The total number of bytes allocated */
+        std::uint64_t allocatedBytes;
+
+        /** The total number of allocations */
+        std::uint64_t allocationCount;
+
+        /**
+         The number of bytes currently allocated. This may be negative if the
+         thread releases memory allocated by other threads.
+        */
+        std::int64_t liveBytes;
+
+        /**
+         The peak of liveBytes since a tracked section last started or
+         resumed on the thread
+        */
+        std::int64_t peakLiveBytes;
+
+    };
+
+public: /* Methods: */
+
+    /** Records an allocation of the given size by the current thread. */
+    static inline void recordAllocation(std::size_t size) noexcept {
+        Counters & c = counters();
+        c.allocatedBytes += size;
+        ++c.allocationCount;
+        c.liveBytes += static_cast<std::int64_t>(size);
+        if (c.liveBytes > c.peakLiveBytes)
+            c.peakLiveBytes = c.liveBytes;
+    }
+
+    /** Records a deallocation of the given size by the current thread. */
+    static inline void recordDeallocation(std::size_t size) noexcept
+    { counters().liveBytes -= static_cast<std::int64_t>(size); }
+
+    /** \returns the counters of the current thread. */
+    static inline Counters & counters() noexcept {
+        static thread_local Counters c{0u, 0u, 0, 0};
+        return c;
+    }
+
+};
+
+/** The reasons a section can be blocked waiting for. */
+enum class ExecutionWaitReason : std::uint32_t {
+    MutexContention,
+    QueuePop,
+    NetworkReceive,
+    Disk,
+    Other
+};
+
+/** The number of values of ExecutionWaitReason */
+constexpr std::size_t executionWaitReasonCount = 5u;
+
+/** \returns the name of the given wait reason, as used in logging output. */
+const char * executionWaitReasonName(ExecutionWaitReason reason) noexcept;
+
+/** Aggregated waits of a single reason. */
+struct ExecutionWaitStatistics {
+
+    /** Adds a wait of the given duration. */
+    inline void add(UsTime duration) noexcept {
+        ++count;
+        totalTime += duration;
+    }
+
+    /** Merges the waits of another set of waits into these. */
+    inline void merge(const ExecutionWaitStatistics & other) noexcept {
+        count += other.count;
+        totalTime += other.totalTime;
+    }
+
+    /** The number of waits */
+    std::uint64_t count = 0u;
+
+    /** The sum of the durations of the waits */
+    UsTime totalTime = 0u;
+
+};
+
+/** Aggregated waits by reason, indexed by ExecutionWaitReason. */
+typedef std::array<ExecutionWaitStatistics, executionWaitReasonCount>
+        ExecutionWaits;
+
+/**
+ A typed key/value attribute of an execution section.
+
+ Keys and string values are interned with ExecutionProfiler::newAttributeKey
+ and ExecutionProfiler::newAttributeValue, hence attributes are stored inline
+ in the section without any allocation.
+*/
+struct ExecutionSectionAttribute {
+
+    enum class Type : std::uint32_t { Integer, String };
+
+    /** The identifier of the interned key */
+    std::uint32_t key;
+
+    /** The type of the value */
+    Type type;
+
+    /** The integer value, or the identifier of the interned string value */
+    std::int64_t value;
+
+    /**
+     \param[in] key the attribute key identifier returned by
+                    ExecutionProfiler::newAttributeKey.
+     \param[in] value the integer value of the attribute.
+     \returns an integer attribute.
+    */
+    static inline ExecutionSectionAttribute integer(std::uint32_t key,
+                                                    std::int64_t value)
+    { return ExecutionSectionAttribute{key, Type::Integer, value}; }
+
+    /**
+     \param[in] key the attribute key identifier returned by
+                    ExecutionProfiler::newAttributeKey.
+     \param[in] value the string value identifier returned by
+                      ExecutionProfiler::newAttributeValue.
+     \returns a string attribute.
+    */
+    static inline ExecutionSectionAttribute string(std::uint32_t key,
+                                                   std::uint32_t value)
+    { return ExecutionSectionAttribute{key, Type::String, value}; }
+
+};
+
 /**
  This is a data structure for storing executed sections for profiling purposes.
 
@@ -135,6 +293,12 @@ public: /* Types: */
         SectionName(std::uint32_t cacheid) : nameCacheId(cacheid) {}
     };
 
+public: /* Constants: */
+
+    /** The maximum number of attributes of a single section */
+    static constexpr std::size_t maxAttributes = 6u;
+    static constexpr std::size_t noParentStackPosition = SIZE_MAX;
+
 public:
 
     /**
@@ -168,6 +332,12 @@ public:
                      #endif
                      );
 
+    /** \returns the duration of the section excluding suspended time. */
+    inline UsTime activeTime() const noexcept {
+        UsTime const duration = endTime - startTime;
+        return duration > suspendedTime ? duration - suspendedTime : 0u;
+    }
+
     /** The identifier of this section */
     std::uint32_t sectionId;
 
@@ -183,6 +353,18 @@ public:
     /** The O(n) complexity parameter for the section */
     std::size_t complexityParameter;
 
+    /** The total time the section has spent suspended */
+    UsTime suspendedTime;
+
+    /** A timestamp for the moment the section was last suspended */
+    UsTime suspendStartTime;
+
+    /** The number of continuous stretches the section has been active in */
+    std::uint32_t segmentCount;
+
+    /** Whether the section is currently suspended */
+    bool suspended;
+
     #ifdef SHAREMIND_NETWORK_STATISTICS_ENABLE
     /**
      * Network statistics for the moment the section started.
@@ -197,11 +379,211 @@ public:
     MinerNetworkStatistics endNetworkStatistics;
     #endif
 
+    /** The attributes of the section */
+    std::array<ExecutionSectionAttribute, maxAttributes> attributes;
+
+    /** The number of attributes of the section */
+    std::size_t attributeCount;
+
+    /** The number of bytes allocated within the section and its children */
+    std::uint64_t allocatedBytes;
+
+    /** The number of allocations within the section and its children */
+    std::uint64_t allocationCount;
+
+    /**
+     The peak number of bytes allocated within the section and its children
+     which were live at the same time
+    */
+    std::uint64_t peakLiveBytes;
+
+    /** The time the section spent blocked, by reason */
+    ExecutionWaits waits;
+
+    /**
+     The deviation of the duration from the cost model of the section type in
+     residual standard deviations, if it exceeded the outlier threshold, and
+     zero otherwise.
+    */
+    double costModelDeviation;
+
 private:
 
     /** The name identifier of this section */
     const SectionName m_sectionName;
     const bool m_nameCached;
+
+    /** Whether allocations are tracked for this section */
+    bool m_allocationTracked;
+
+    /**
+     The allocation counters of the thread which started or last resumed the
+     section, or null if the section is not tracking allocations at the moment
+    */
+    ExecutionAllocationTracker::Counters * m_allocationCounters;
+
+    /** The values of the counters when the section was started or resumed */
+    ExecutionAllocationTracker::Counters m_allocationStart;
+
+    /**
+     The peak of live bytes since the section was started or resumed, up to
+     the start of the next tracked section on the same thread
+    */
+    std::int64_t m_allocationPeak;
+
+    /** Whether the section has been written to the emergency file */
+    bool m_emergencyFlushed;
+
+    /**
+     The position the section was removed from the parent section stack at
+     while suspended, or noParentStackPosition if it was not removed
+    */
+    std::size_t m_parentStackPosition;
+};
+
+
+/**
+ A linear cost model fitted online by least squares, i.e. a running linear
+ regression of a cost (e.g. duration) against the complexity parameter.
+*/
+struct ExecutionCostModel {
+
+    /** Adds an observation of the given cost at the given complexity. */
+    void add(double complexity, double cost) noexcept;
+
+    /** Merges the observations of another model into this one. */
+    void merge(const ExecutionCostModel & other) noexcept;
+
+    /** \returns the fitted cost per unit of complexity. */
+    double slope() const noexcept;
+
+    /** \returns the fitted cost at zero complexity. */
+    double intercept() const noexcept;
+
+    /** \returns the standard deviation of the residuals of the fit. */
+    double residualStdDev() const noexcept;
+
+    /** \returns the cost predicted by the model at the given complexity. */
+    inline double predict(double complexity) const noexcept
+    { return intercept() + slope() * complexity; }
+
+    /** The number of observations */
+    std::uint64_t count = 0u;
+
+    /** The means of the observed complexities and costs */
+    double meanComplexity = 0.0;
+    double meanCost = 0.0;
+
+    /** The sums of squared deviations and cross-deviations from the means */
+    double complexityM2 = 0.0;
+    double costM2 = 0.0;
+    double comoment = 0.0;
+
+};
+
+/**
+ Aggregated statistics of all completed sections of a single section type.
+*/
+struct ExecutionSectionTypeStatistics {
+
+    /** Merges the statistics of another set of sections into these. */
+    void merge(const ExecutionSectionTypeStatistics & other) noexcept;
+
+    /** The number of completed sections */
+    std::uint64_t count = 0u;
+
+    /** The sum of the durations of the completed sections */
+    UsTime totalDuration = 0u;
+
+    /** The sum of the times the completed sections spent suspended */
+    UsTime totalSuspendedTime = 0u;
+
+    /** The sum of the active segment counts of the completed sections */
+    std::uint64_t totalSegmentCount = 0u;
+
+    /** The duration of the shortest completed section */
+    UsTime minDuration = 0u;
+
+    /** The duration of the longest completed section */
+    UsTime maxDuration = 0u;
+
+    /** The sum of the complexity parameters of the completed sections */
+    std::uint64_t totalComplexity = 0u;
+
+    /** The sum of the bytes allocated within the completed sections */
+    std::uint64_t totalAllocatedBytes = 0u;
+
+    /** The sum of the allocations within the completed sections */
+    std::uint64_t totalAllocationCount = 0u;
+
+    /** The largest peak of live bytes of the completed sections */
+    std::uint64_t maxPeakLiveBytes = 0u;
+
+    /** The time the completed sections spent blocked, by reason */
+    ExecutionWaits waits;
+
+    /**
+     The time sections spent waiting for network receives, by peer. Unlike
+     the other statistics, this includes the waits of sections which are
+     still open.
+    */
+    std::map<std::size_t, ExecutionWaitStatistics> networkReceiveWaitsByPeer;
+
+    /**
+     The model of the active duration (excluding suspended time) in
+     microseconds against complexity
+    */
+    ExecutionCostModel durationModel;
+
+    #ifdef SHAREMIND_NETWORK_STATISTICS_ENABLE
+    /** The model of the bytes transferred against complexity */
+    ExecutionCostModel bytesModel;
+    #endif
+
+    /**
+     The number of sections whose duration deviated from durationModel by
+     more than the threshold set by
+     ExecutionProfiler::setCostModelOutlierThreshold
+    */
+    std::uint64_t outlierCount = 0u;
+
+};
+
+/**
+ A point-in-time view of the profiling state, as returned by
+ ExecutionProfiler::snapshot().
+*/
+struct ExecutionProfilerSnapshot {
+
+    /** Describes a section which has been started, but not yet ended. */
+    struct OpenSection {
+        std::string name;
+        std::uint32_t sectionId;
+        std::uint32_t parentSectionId;
+        std::size_t complexityParameter;
+
+        /** The time elapsed since the section was started */
+        UsTime age;
+
+        /** The time the section has spent suspended so far */
+        UsTime suspendedTime;
+
+        /** Whether the section is currently suspended */
+        bool suspended;
+    };
+
+    /** The moment the snapshot was taken */
+    UsTime time = 0u;
+
+    /** Statistics of completed sections, by section type name */
+    std::map<std::string, ExecutionSectionTypeStatistics> sectionTypeStatistics;
+
+    /** The currently open sections, ordered by section identifier */
+    std::vector<OpenSection> openSections;
+
+    /** The number of completed sections waiting to be written to the log */
+    std::size_t pendingSections = 0u;
+
 };
 
 
@@ -215,16 +597,26 @@ private:
 */
 class ExecutionProfiler {
 
+public: /* Constants: */
+
+    /** The peer argument of recordWait for waits not related to a peer */
+    static constexpr std::size_t noPeer = SIZE_MAX;
+
 public: /* Methods: */
 
     ExecutionProfiler(const LogHard::Logger & logger)
         : m_logger(logger, "[ExecutionProfiler]")
+        , m_logWriter(m_logger)
+        , m_ring(m_logger)
         , m_nextSectionTypeId(0)
         , m_nextSectionId(1)
         , m_profilingActive(false)
     {}
 
-    inline ~ExecutionProfiler() noexcept { finishLog(); }
+    inline ~ExecutionProfiler() noexcept {
+        disableEmergencyFlush();
+        finishLog();
+    }
 
     /**
      Starts the profiler by specifying a log file to write sections into.
@@ -232,10 +624,38 @@ public: /* Methods: */
      The profiler will open a file with the given name and will log all sections to this file.
 
      \param[in] filename the name of the file to log the sections to
+     \param[in] options options for compressing and rotating the log
 
      \returns whether opening the file was successful
     */
-    bool startLog(const std::string &filename);
+    bool startLog(const std::string &filename,
+                  const ExecutionProfilerLogOptions & options =
+                        ExecutionProfilerLogOptions());
+
+    /**
+     Starts the profiler by specifying a shared memory ring to publish
+     completed sections into.
+
+     Instead of being written to a file, completed sections are published by
+     processLog into a POSIX shared memory ring (see ExecutionSectionRing)
+     from which a separate process on the same host can consume them at its
+     own pace. If the consumer falls behind, sections are dropped and counted
+     in the ring header instead of blocking the profiler. This can be used
+     together with or instead of startLog.
+
+     \param[in] shmName the name of the shared memory object to create
+     \param[in] capacity the number of sections the ring can hold
+     \param[in] nameCapacity the number of section type names the ring can hold
+     \param[in] nameSize the maximum length of names in the ring, including
+                         the terminating null character. Longer names are
+                         truncated.
+
+     \returns whether creating the shared memory ring was successful
+    */
+    bool startSharedMemoryLog(const std::string & shmName,
+                              std::uint32_t capacity = 65536u,
+                              std::uint32_t nameCapacity = 4096u,
+                              std::uint32_t nameSize = 128u);
 
     /**
      Defines a new section type.
@@ -248,6 +668,54 @@ public: /* Methods: */
     */
     std::uint32_t newSectionType(const char *name);
 
+    /**
+     Interns a section attribute key.
+
+     \param[in] name the name of the attribute key, as used in the logging
+                     output.
+     \returns a unique identifier for the attribute key.
+    */
+    std::uint32_t newAttributeKey(const char * name);
+
+    /**
+     Interns a string value of section attributes.
+
+     \param[in] value the string value, as used in the logging output.
+     \returns a unique identifier for the string value.
+    */
+    std::uint32_t newAttributeValue(const char * value);
+
+    /**
+     Sets an integer attribute of an open section.
+
+     Attributes can be set any time between starting and ending the section.
+     Setting an attribute with the same key again replaces its value.
+
+     \param[in] sectionId the id returned by StartSection.
+     \param[in] key the attribute key identifier returned by newAttributeKey.
+     \param[in] value the integer value of the attribute.
+     \returns false if no such section has been started, or the section
+               already has ExecutionSection::maxAttributes other attributes.
+    */
+    bool setSectionAttribute(std::uint32_t sectionId,
+                             std::uint32_t key,
+                             std::int64_t value);
+
+    /**
+     Sets a string attribute of an open section.
+
+     \param[in] sectionId the id returned by StartSection.
+     \param[in] key the attribute key identifier returned by newAttributeKey.
+     \param[in] value the string value identifier returned by
+                      newAttributeValue.
+     \returns false if no such section has been started, or the section
+               already has ExecutionSection::maxAttributes other attributes.
+     \see setSectionAttribute
+    */
+    bool setSectionStringAttribute(std::uint32_t sectionId,
+                                   std::uint32_t key,
+                                   std::uint32_t value);
+
     template<class T>
     std::uint32_t addSection(T sectionTypeName,
                              std::size_t complexityParameter,
@@ -268,7 +736,7 @@ public: /* Methods: */
         // Automatically set parent
         std::uint32_t const usedParentSectionId =
                 parentSectionId == 0 && !m_parentSectionStack.empty()
-                ? m_parentSectionStack.top()
+                ? m_parentSectionStack.back()
                 : parentSectionId;
 
         // Create the entry and store it
@@ -285,6 +753,7 @@ public: /* Methods: */
                     #endif
                     );
 
+        updateSectionTypeStatistics(*s);
         m_sections.push_back(s);
 
         return s->sectionId;
@@ -313,6 +782,8 @@ public: /* Methods: */
         return startSection_<T>(std::move(sectionTypeName),
                                  complexityParameter,
                                  startNetStats,
+                                 nullptr,
+                                 0u,
                                  parentSectionId);
     }
     #endif
@@ -328,6 +799,42 @@ public: /* Methods: */
                     #ifdef SHAREMIND_NETWORK_STATISTICS_ENABLE
                     MinerNetworkStatistics(),
                     #endif
+                    nullptr,
+                    0u,
+                    parentSectionId);
+    }
+
+    /**
+     Specifies the starting point of a code section for profiling and sets
+     its attributes.
+
+     This is equivalent to startSection followed by setSectionAttribute for
+     every attribute, but the attributes are set under the same lock as the
+     section is started.
+
+     \param[in] sectionTypeName a value that specifies the type name of a section describing what is being done in the section
+     \param[in] complexityParameter indicates the complexity parameter for the section (eg number of values in the processed vector)
+     \param[in] attributes the attributes of the section. Attributes beyond
+                           ExecutionSection::maxAttributes are ignored.
+     \param[in] parentSectionId the identifier of a section which contains this new section (see also: PushParentSection)
+
+     \returns an unique identifier for the profiled code section which should be passed to EndSection later on
+    */
+    template<class T>
+    std::uint32_t startSection(
+            T sectionTypeName,
+            std::size_t complexityParameter,
+            std::initializer_list<ExecutionSectionAttribute> attributes,
+            std::uint32_t parentSectionId = 0)
+    {
+        return startSection_<T>(
+                    sectionTypeName,
+                    complexityParameter,
+                    #ifdef SHAREMIND_NETWORK_STATISTICS_ENABLE
+                    MinerNetworkStatistics(),
+                    #endif
+                    attributes.begin(),
+                    attributes.size(),
                     parentSectionId);
     }
 
@@ -341,6 +848,21 @@ public: /* Methods: */
     */
     void endSection(std::uint32_t sectionId);
 
+    /**
+     Completes the specified section and sets its attributes.
+
+     This is equivalent to setSectionAttribute for every attribute followed
+     by endSection, but the attributes are set under the same lock as the
+     section is completed.
+
+     \param[in] sectionId the id returned by StartSection. If no such section has been started, the method does nothing.
+     \param[in] attributes the attributes of the section. Attributes beyond
+                           ExecutionSection::maxAttributes are ignored.
+    */
+    void endSection(
+            std::uint32_t sectionId,
+            std::initializer_list<ExecutionSectionAttribute> attributes);
+
     /**
      Completes the specified section.
 
@@ -358,18 +880,115 @@ public: /* Methods: */
                     #endif
                     );
 
+    /**
+     Suspends the specified section.
+
+     This is used for sections which wait for an external event, e.g. a
+     network bound protocol step waiting for a message from a peer, so that
+     the waiting time is accounted separately from the active time of the
+     section. Sections can be suspended and resumed any number of times and
+     from any thread. Ending a suspended section counts the time since it was
+     suspended as suspended time.
+
+     \param[in] sectionId the id returned by StartSection. If no such section
+                          has been started or it is already suspended, the
+                          method does nothing.
+     \param[in] removeFromParentStack whether to remove the section from the
+                                      parent section stack (see
+                                      pushParentSection) while it is
+                                      suspended. It is put back to the same
+                                      position of the stack when resumed.
+    */
+    void suspendSection(std::uint32_t sectionId,
+                        bool removeFromParentStack = false);
+
+    /**
+     Resumes the specified section after it has been suspended.
+
+     \param[in] sectionId the id returned by StartSection. If no such section
+                          has been started or it is not suspended, the method
+                          does nothing.
+     \see suspendSection
+    */
+    void resumeSection(std::uint32_t sectionId);
+
     /**
      Finishes profiling and writes cached section to the log file.
     */
     void finishLog();
 
-    /** \brief Processes and writes all sections cached in memory to disk. */
+    /**
+     Enables the emergency flush path of the profiler.
+
+     Opens the given file and pre-allocates a buffer, so that emergencyFlush
+     can later write the sections which have not yet been written to the log
+     without allocating memory or taking locks. This also makes the profiler
+     handle fork(): the child process drops the state and file handles
+     inherited from the parent and stops profiling, so that sections are
+     neither lost nor written twice.
+
+     \param[in] filename the name of the file emergencyFlush writes to
+     \param[in] bufferSize the size of the pre-allocated formatting buffer
+
+     \returns whether opening the file was successful
+    */
+    bool enableEmergencyFlush(const std::string & filename,
+                              std::size_t bufferSize = 65536u);
+
+    /**
+     Disables the emergency flush path and closes its file, if enabled.
+    */
+    void disableEmergencyFlush() noexcept;
+
+    /**
+     Writes all completed sections not yet written to the log and all still
+     open sections to the emergency file.
+
+     Sections already formatted for the log, but still buffered in memory, are
+     written to the log file itself if it is uncompressed and not being
+     written to at the moment, and to the emergency file otherwise. Completed sections written to
+     the emergency file are not written to the log later, but sections which
+     were still open may later be written to the log once completed.
+
+     This method only uses async-signal-safe operations and does not take the
+     profiler lock, so it can be called from a signal handler, e.g. one
+     installed by installEmergencyFlushSignalHandler. As a consequence, the
+     output may be inconsistent if the signal interrupted the profiler while
+     it was modifying its state. Only the first call after
+     enableEmergencyFlush writes anything.
+    */
+    void emergencyFlush() noexcept;
+
+    /**
+     Installs a handler for the given signal which calls emergencyFlush on all
+     profilers with the emergency flush path enabled.
+
+     After flushing, the handler calls the previously installed handler of
+     the signal, or re-raises the signal with its default disposition if there
+     was none.
+
+     \param[in] signalNumber the signal to handle, e.g. SIGTERM or SIGSEGV
+
+     \returns whether installing the handler was successful
+    */
+    static bool installEmergencyFlushSignalHandler(int signalNumber);
+
+    /**
+     \brief Processes and writes all sections cached in memory to disk.
+
+     The sections are formatted into blocks which are written to disk by a
+     background thread, hence they may reach the disk shortly after this
+     method returns.
+    */
     void processLog();
 
     /**
      \brief Processes and writes sections cached in memory to disk until the
             given duration of time in ms has been exceeded.
 
+     Like processLog(), this hands the processed sections to the background
+     thread to be written.
+
      \param[in] timeLimitMs the number of milliseconds allowed for processing
                             the sections. If this is zero, no sections are
                             processed.
@@ -398,6 +1017,94 @@ public: /* Methods: */
     */
     void popParentSection();
 
+    /**
+     Takes a snapshot of the current profiling state.
+
+     The profiler lock is only held while copying the per-type statistics and
+     the identifiers and timestamps of the open sections, which takes time
+     linear in the number of section types and open sections. Names are
+     resolved and statistics of section types sharing a name are merged
+     after releasing the lock.
+
+     \returns the aggregated statistics of all sections completed since
+               startLog, the currently open sections and the number of
+               sections waiting to be written to the log.
+    */
+    ExecutionProfilerSnapshot snapshot();
+
+    /**
+     Records a wait of an open section.
+
+     This is much cheaper than profiling the wait as a child section, as the
+     wait is only added to the per-reason totals of the section. See
+     ExecutionProfilerWait.h for helpers which time waits automatically.
+
+     The waiting section has to be given explicitly, since the parent section
+     stack is shared by all threads and its top is not necessarily a section
+     of the waiting thread.
+
+     \param[in] sectionId the id returned by StartSection. If no such section
+                          has been started, e.g. because it was started while
+                          profiling was not active, the method does nothing.
+     \param[in] reason the reason the section was blocked for
+     \param[in] startTime the moment the wait started
+     \param[in] endTime the moment the wait ended
+     \param[in] peer the peer waited for in case of network receives, or
+                     noPeer
+    */
+    void recordWait(std::uint32_t sectionId,
+                    ExecutionWaitReason reason,
+                    UsTime startTime,
+                    UsTime endTime,
+                    std::size_t peer = noPeer);
+
+    /**
+     Enables or disables tracking allocations in sections.
+
+     When enabled, sections record the bytes allocated, the number of
+     allocations and the peak of live bytes reported to
+     ExecutionAllocationTracker by the thread which started the section,
+     including allocations in child sections. While a section is suspended,
+     its allocations are not tracked, and once resumed, the allocations of
+     the resuming thread are tracked. The allocations of the thread since the
+     section was started or last resumed are only attributed to it if it is
+     suspended or ended on the same thread.
+
+     \param[in] enabled whether to track allocations
+    */
+    void setAllocationTracking(bool enabled);
+
+    /**
+     Enables flagging sections which deviate far from the cost model of their
+     section type.
+
+     A completed section is flagged if its duration differs from the duration
+     predicted by the model of its type by more than the given number of
+     residual standard deviations. Flagged sections are counted in the section
+     type statistics and their deviation is written to the CostModelDeviation
+     column of the log and to the shared memory log.
+
+     \param[in] threshold the number of residual standard deviations, or zero
+                          to disable flagging.
+     \param[in] minSamples the number of sections of a type required before
+                           the model of the type is considered reliable.
+    */
+    void setCostModelOutlierThreshold(double threshold,
+                                      std::uint64_t minSamples = 100u);
+
+
+private: /* Constants: */
+
+    /** The number of name pointers of uncached section types remembered */
+    static constexpr std::size_t maxSectionNameIds = 4096u;
+
+private: /* Types: */
+
+    /**
+     Identifies a section type by its cached name id or the id of its
+     interned name
+    */
+    typedef std::pair<bool, std::uint32_t> SectionTypeKey;
 
 private: /* Methods: */
 
@@ -410,6 +1117,8 @@ private: /* Methods: */
      \param[in] sectionTypeName a value that specifies the type name of a section describing what is being done in the section
      \param[in] complexityParameter indicates the complexity parameter for the section (eg number of values in the processed vector)
      \param[in] startNetStats the network statistics measured in the beginning of the section.
+     \param[in] attributes the attributes to set, may be null if attributeCount is zero.
+     \param[in] attributeCount the number of attributes.
      \param[in] parentSectionId the identifier of a section which contains this new section (see also: PushParentSection)
 
      \returns an unique identifier for the profiled code section which should be passed to EndSection later on
@@ -421,6 +1130,8 @@ private: /* Methods: */
             #ifdef SHAREMIND_NETWORK_STATISTICS_ENABLE
             const MinerNetworkStatistics & startNetStats,
             #endif
+            const ExecutionSectionAttribute * attributes,
+            std::size_t attributeCount,
             std::uint32_t parentSectionId = 0)
     {
         if (!m_profilingActive)
@@ -432,7 +1143,7 @@ private: /* Methods: */
         // Automatically set parent
         std::uint32_t const usedParentSectionId =
                 parentSectionId == 0 && !m_parentSectionStack.empty()
-                ? m_parentSectionStack.top()
+                ? m_parentSectionStack.back()
                 : parentSectionId;
 
         // Create the entry and store it
@@ -449,23 +1160,86 @@ private: /* Methods: */
                     #endif
                     );
 
+        for (std::size_t i = 0u; i < attributeCount; ++i)
+            applySectionAttribute(*s, attributes[i]);
+
         m_sectionMap.insert(std::make_pair(s->sectionId, s));
+        if (m_allocationTracking) {
+            s->m_allocationTracked = true;
+            startAllocationSegment(*s);
+        }
         s->startTime = getUsTime();
         //WRITE_LOG_FULLDEBUG (m_logger, "[ExecutionProfiler] Started section " << s.sectionId << ".");
         return s->sectionId;
     }
 
+    void resetAfterFork() noexcept;
+    static void prepareForkHandler() noexcept;
+    static void parentForkHandler() noexcept;
+    static void childForkHandler() noexcept;
+    static void emergencySignalHandler(int signalNumber,
+                                       siginfo_t * info,
+                                       void * context);
+
     void processLog_();
     void processLog_(std::uint32_t timeLimitMs);
     void processLogStep();
+    void publishSection(const ExecutionSection & s);
+    void closeSharedMemoryLog();
+    std::uint32_t internAttributeString(const char * str);
+    std::uint32_t internSectionName(const char * name);
+    bool setSectionAttribute_(std::uint32_t sectionId,
+                              const ExecutionSectionAttribute & attribute);
+    static bool applySectionAttribute(
+            ExecutionSection & s,
+            const ExecutionSectionAttribute & attribute) noexcept;
+    void endSection_(std::uint32_t sectionId,
+                     const UsTime endTime,
+                     #ifdef SHAREMIND_NETWORK_STATISTICS_ENABLE
+                     const MinerNetworkStatistics & endNetStats,
+                     #endif
+                     const ExecutionSectionAttribute * attributes,
+                     std::size_t attributeCount);
+    std::uint32_t getRingAttributeNameIndex(std::uint32_t attributeStringId);
+
+    inline const char * getAttributeString(std::uint32_t id) const {
+        return id < m_attributeStrings.size()
+               ? m_attributeStrings[id]
+               : "undefined_attribute";
+    }
 
-    inline const char * getSectionName(ExecutionSection * s) const {
-        if (s->m_nameCached) {
-            auto const it(m_sectionTypes.find(s->m_sectionName.nameCacheId));
-            return (it == m_sectionTypes.end() ? "undefined_section" : it->second);
-        } else {
-            return s->m_sectionName.namePtr;
-        }
+    void updateSectionTypeStatistics(ExecutionSection & s);
+    static void startAllocationSegment(ExecutionSection & s);
+    static void endAllocationSegment(ExecutionSection & s) noexcept;
+
+    /**
+     \returns the type of the given section. Uncached names are interned, as
+               they only need to remain valid until the section is written.
+    */
+    inline SectionTypeKey getSectionTypeKey(const ExecutionSection & s) {
+        return s.m_nameCached
+               ? SectionTypeKey(true, s.m_sectionName.nameCacheId)
+               : SectionTypeKey(false,
+                                internSectionName(s.m_sectionName.namePtr));
+    }
+
+    inline const char * getCachedSectionName(std::uint32_t id) const {
+        auto const it(m_sectionTypes.find(id));
+        return (it == m_sectionTypes.end() ? "undefined_section" : it->second);
+    }
+
+    /** \returns the name of the section type, valid as long as the profiler */
+    inline const char * getSectionTypeName(const SectionTypeKey & key) const {
+        return key.first
+               ? getCachedSectionName(key.second)
+               : getAttributeString(key.second);
+    }
+
+    /** \returns the name of the section, valid until the section is written */
+    inline const char * getSectionName(const ExecutionSection * s) const {
+        return s->m_nameCached
+               ? getCachedSectionName(s->m_sectionName.nameCacheId)
+               : s->m_sectionName.namePtr;
     }
 
 private: /* Fields: */
@@ -475,8 +1249,20 @@ private: /* Fields: */
     /** The name of the logfile to use */
     std::string m_filename;
 
-    /** Handle of the file we write the profiling log to */
-    std::ofstream m_logfile;
+    /** The writer of the profiling log */
+    ExecutionProfilerLogWriter m_logWriter;
+
+    /** The shared memory ring we publish completed sections to */
+    ExecutionSectionRing m_ring;
+
+    /** The name table indices of section types published to the ring */
+    std::map<SectionTypeKey, std::uint32_t> m_ringNameIndices;
+
+    /** The name table indices of attribute strings published to the ring */
+    std::vector<std::uint32_t> m_ringAttributeNameIndices;
+
+    /** Whether the last section published to the ring was dropped */
+    bool m_ringOverrun = false;
 
     /** The map of section types */
     std::map<std::uint32_t, char *> m_sectionTypes;
@@ -484,12 +1270,25 @@ private: /* Fields: */
     /** The next available section type identifier */
     std::uint32_t m_nextSectionTypeId;
 
+    /** The interned attribute keys and string values, by identifier */
+    std::vector<const char *> m_attributeStrings;
+
+    /** The identifiers of the interned attribute keys and string values */
+    std::map<std::string, std::uint32_t> m_attributeStringIds;
+
+    /**
+     The interned names of uncached section types by the name pointers seen
+     recently. The pointers are only a hint, since the memory of a name may be
+     reused for another name once its sections have been written.
+    */
+    std::unordered_map<const char *, std::uint32_t> m_sectionNameIds;
+
     /**
      The stack of parent section identifiers.
 
      \see PushParentSection
     */
-    std::stack<std::uint32_t> m_parentSectionStack;
+    std::vector<std::uint32_t> m_parentSectionStack;
 
     /**
      The map of execution sections
@@ -501,6 +1300,15 @@ private: /* Fields: */
     /** The cache of sections waiting for flushing to the disk */
     std::deque<ExecutionSection*> m_sections;
 
+    /** Statistics of completed sections, by section type */
+    std::map<SectionTypeKey, ExecutionSectionTypeStatistics> m_sectionTypeStatistics;
+
+    /** The cost model outlier threshold, or zero if disabled */
+    double m_costModelOutlierThreshold = 0.0;
+
+    /** The number of samples required to flag cost model outliers */
+    std::uint64_t m_costModelMinSamples = 100u;
+
     /** The next available section identifier */
     std::uint32_t m_nextSectionId;
 
@@ -510,6 +1318,21 @@ private: /* Fields: */
     /** True, if profiling is active */
     bool m_profilingActive;
 
+    /** True, if allocations are tracked in sections */
+    bool m_allocationTracking = false;
+
+    /** The file descriptor of the emergency file, or -1 if not enabled */
+    int m_emergencyFd = -1;
+
+    /** The pre-allocated buffer used by emergencyFlush */
+    std::unique_ptr<char[]> m_emergencyBuffer;
+
+    /** The size of m_emergencyBuffer */
+    std::size_t m_emergencyBufferSize = 0u;
+
+    /** Whether emergencyFlush has already been called */
+    std::atomic<bool> m_emergencyFlushed{false};
+
 };
 
 /**
@@ -550,6 +1373,9 @@ public:
         m_profiler.endSection(m_sectionId);
     }
 
+    /** \returns the identifier of the section, e.g. for setting attributes. */
+    std::uint32_t sectionId() const noexcept { return m_sectionId; }
+
 private:
     /** The identifier of the section to end. */
     std::uint32_t m_sectionId;
@@ -561,6 +1387,75 @@ private:
     ExecutionProfiler& m_profiler;
 };
 
+/**
+ This class is used to suspend an ExecutionProfiler section for as long as an
+ instance of this class is alive, e.g. while an asynchronous operation or a
+ coroutine is waiting.
+
+ Instances can be moved, so they can be kept in a coroutine frame or handed to
+ a continuation running on another thread, which resumes the section by
+ destroying the instance or calling resume().
+*/
+class ExecutionSectionSuspension {
+
+public:
+    /**
+     Suspends the given section.
+
+     \param[in] profiler the profiler instance the section was started on
+     \param[in] sectionId the identifier of the section to suspend
+     \param[in] isParent whether the section has been pushed as a parent
+                         section, in which case it is removed from the parent
+                         section stack while suspended and put back to the
+                         same position when resumed
+    */
+    ExecutionSectionSuspension(ExecutionProfiler & profiler,
+                               std::uint32_t sectionId,
+                               bool isParent = false)
+        : m_profiler(&profiler)
+        , m_sectionId(sectionId)
+        , m_isParent(isParent)
+    { m_profiler->suspendSection(m_sectionId, m_isParent); }
+
+    ExecutionSectionSuspension(ExecutionSectionSuspension && move) noexcept
+        : m_profiler(move.m_profiler)
+        , m_sectionId(move.m_sectionId)
+        , m_isParent(move.m_isParent)
+    { move.m_profiler = nullptr; }
+
+    ExecutionSectionSuspension(const ExecutionSectionSuspension &) = delete;
+    ExecutionSectionSuspension & operator=(ExecutionSectionSuspension &&)
+            = delete;
+    ExecutionSectionSuspension & operator=(
+            const ExecutionSectionSuspension &) = delete;
+
+    /**
+     Resumes the section, if not already resumed
+    */
+    ~ExecutionSectionSuspension() { resume(); }
+
+    /**
+     Resumes the section before the instance is destroyed.
+    */
+    void resume() {
+        if (!m_profiler)
+            return;
+
+        m_profiler->resumeSection(m_sectionId);
+        m_profiler = nullptr;
+    }
+
+private:
+    /** Points to the ExecutionProfiler instance, or null if resumed. */
+    ExecutionProfiler * m_profiler;
+
+    /** The identifier of the suspended section. */
+    std::uint32_t m_sectionId;
+
+    /** Indicates whether the section is removed from the parent stack. */
+    bool m_isParent;
+};
+
 } /* namespace sharemind { */
 
 #endif /* SHAREMIND_EXECUTIONPROFILER_H */
@@ -0,0 +1,320 @@
+/*
+ * Copyright (C) 2015 Cybernetica
+ *
+ * Research/Commercial License Usage
+ * Licensees holding a valid Research License or Commercial License
+ * for the Software may use this file according to the written
+ * agreement between you and Cybernetica.
+ *
+ * GNU General Public License Usage
+ * Alternatively, this file may be used under the terms of the GNU
+ * General Public License version 3.0 as published by the Free Software
+ * Foundation and appearing in the file LICENSE.GPL included in the
+ * packaging of this file.  Please review the following information to
+ * ensure the GNU General Public License version 3.0 requirements will be
+ * met: http://www.gnu.org/copyleft/gpl-3.0.html.
+ *
+ * For further information, please contact us at sharemind@cyber.ee.
+ */
+
+
+#include "ExecutionProfilerLogWriter.h"
+
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <new>
+#include <sharemind/MicrosecondTime.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utility>
+#include <zlib.h>
+
+
+namespace sharemind {
+
+ExecutionProfilerLogWriter::BlockBuffer::int_type
+ExecutionProfilerLogWriter::BlockBuffer::overflow(int_type c) {
+    if (!traits_type::eq_int_type(c, traits_type::eof()))
+        m_block.push_back(traits_type::to_char_type(c));
+    return traits_type::not_eof(c);
+}
+
+std::streamsize ExecutionProfilerLogWriter::BlockBuffer::xsputn(
+        const char * s,
+        std::streamsize n)
+{
+    m_block.append(s, static_cast<std::size_t>(n));
+    return n;
+}
+
+bool ExecutionProfilerLogWriter::open(
+        const std::string & filename,
+        const std::string & header,
+        const ExecutionProfilerLogOptions & options)
+{
+    assert(!filename.empty());
+    assert(options.blockSize > 0u);
+
+    close();
+
+    m_filename = filename;
+    m_header = header;
+    m_options = options;
+    m_segmentNumber = 0u;
+    m_writeFailed = false;
+    m_droppedBlocks = 0u;
+    m_stop = false;
+
+    // Remove the segments of an earlier log with the same name, so they are
+    // not mistaken for segments of this log:
+    if (isRotating())
+        for (std::uint64_t i = 0u;; ++i)
+            if (::unlink((m_filename + '.' + std::to_string(i)).c_str()) != 0)
+                break;
+
+    if (!openSegment())
+        return false;
+
+    m_buffer.block().reserve(m_options.blockSize + m_options.blockSize / 4u);
+    m_thread = std::thread(&ExecutionProfilerLogWriter::run, this);
+    return true;
+}
+
+void ExecutionProfilerLogWriter::close() noexcept {
+    if (!m_thread.joinable())
+        return;
+
+    try {
+        if (!m_buffer.block().empty())
+            handOffBlock(true);
+    } catch (...) {
+        m_logger.error() << "Failed to write the last block of log file '"
+                         << m_filename << "'!";
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_queueMutex);
+        m_stop = true;
+    }
+    m_queueCondition.notify_one();
+    m_thread.join();
+
+    m_buffer.block().clear();
+    closeSegment();
+
+    if (m_droppedBlocks > 0u)
+        m_logger.warning() << "Dropped " << m_droppedBlocks << " blocks of "
+                              "profiler log file '" << m_filename
+                           << "' because writing could not keep up.";
+}
+
+void ExecutionProfilerLogWriter::writeAll(int fd,
+                                          const char * data,
+                                          std::size_t size) noexcept
+{
+    while (size > 0u) {
+        ssize_t const r = ::write(fd, data, size);
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+        data += r;
+        size -= static_cast<std::size_t>(r);
+    }
+}
+
+void ExecutionProfilerLogWriter::resetAfterFork() noexcept {
+    // The background thread does not exist in the child, but the state
+    // shared with it was locked by prepareFork():
+    m_queueMutex.unlock();
+    new (&m_queueCondition) std::condition_variable();
+    new (&m_thread) std::thread();
+
+    m_queue.clear();
+    m_buffer.block().clear();
+    m_stop = false;
+
+    if (m_fd >= 0) {
+        ::close(m_fd);
+        m_fd = -1;
+    }
+}
+
+void ExecutionProfilerLogWriter::flush() {
+    if (m_buffer.block().empty())
+        return;
+
+    // Only this thread adds blocks, so the queue does not fill up meanwhile:
+    {
+        std::lock_guard<std::mutex> lock(m_queueMutex);
+        if (m_queue.size() >= m_options.maxQueuedBlocks)
+            return;
+    }
+    handOffBlock(true);
+}
+
+void ExecutionProfilerLogWriter::handOffBlock(bool force) {
+    std::string block;
+    block.reserve(m_options.blockSize + m_options.blockSize / 4u);
+    block.swap(m_buffer.block());
+
+    {
+        std::lock_guard<std::mutex> lock(m_queueMutex);
+        if (!force && m_queue.size() >= m_options.maxQueuedBlocks) {
+            if (m_droppedBlocks++ == 0u)
+                m_logger.warning() << "Writing profiler log file '"
+                                   << m_filename << "' can not keep up, "
+                                      "dropping blocks.";
+            return;
+        }
+        m_queue.push_back(std::move(block));
+    }
+    m_queueCondition.notify_one();
+}
+
+void ExecutionProfilerLogWriter::run() {
+    std::unique_lock<std::mutex> lock(m_queueMutex);
+    for (;;) {
+        m_queueCondition.wait(lock,
+                              [this]() { return m_stop || !m_queue.empty(); });
+        if (m_queue.empty())
+            return;
+
+        std::string block(std::move(m_queue.front()));
+        m_queue.pop_front();
+        m_writing = true;
+        lock.unlock();
+
+        bool const rotate =
+                (m_options.maxSegmentSize > 0u
+                 && m_segmentSize >= m_options.maxSegmentSize)
+                || (m_options.maxSegmentSeconds > 0u
+                    && getUsTime() - m_segmentStartTime
+                       >= m_options.maxSegmentSeconds * UsTime(1000000u));
+        if (rotate) {
+            closeSegment();
+            ++m_segmentNumber;
+            if (m_options.maxSegments > 0u
+                && m_segmentNumber >= m_options.maxSegments)
+            {
+                std::string const oldest(
+                        m_filename + '.' + std::to_string(
+                            m_segmentNumber - m_options.maxSegments));
+                if (::unlink(oldest.c_str()) != 0 && errno != ENOENT)
+                    m_logger.warning() << "Can not remove profiler log file '"
+                                       << oldest << "': "
+                                       << std::strerror(errno);
+            }
+            openSegment();
+        }
+
+        writeBlock(block);
+        lock.lock();
+        m_writing = false;
+    }
+}
+
+bool ExecutionProfilerLogWriter::openSegment() {
+    assert(m_fd < 0);
+
+    m_segmentName = m_filename;
+    if (isRotating())
+        m_segmentName += '.' + std::to_string(m_segmentNumber);
+
+    // Note: the file is truncated so that when a script does not have
+    // profiling sections, the old results are not left into the profile log.
+    m_fd = ::open(m_segmentName.c_str(),
+                  O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                  S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (m_fd < 0) {
+        m_logger.error() << "Can not open profiler log file '"
+                         << m_segmentName << "': " << std::strerror(errno);
+        return false;
+    }
+
+    m_logger.debug() << "Opened profiling log file '" << m_segmentName
+                     << "'!";
+
+    m_segmentSize = 0u;
+    m_segmentStartTime = getUsTime();
+    m_writeFailed = false;
+    writeBlock(m_header);
+    return true;
+}
+
+void ExecutionProfilerLogWriter::writeBlock(const std::string & block) {
+    if (m_fd < 0 || block.empty())
+        return;
+
+    if (!m_options.compress) {
+        writeData(block.data(), block.size());
+        return;
+    }
+
+    // Every block is written as a separate gzip member:
+    z_stream zs;
+    std::memset(&zs, 0, sizeof(zs));
+    if (deflateInit2(&zs,
+                     Z_DEFAULT_COMPRESSION,
+                     Z_DEFLATED,
+                     15 + 16,
+                     8,
+                     Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+        m_logger.error() << "Can not initialize log compression!";
+        return;
+    }
+
+    std::string compressed(deflateBound(&zs, block.size()), '\0');
+    zs.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(block.data()));
+    zs.avail_in = static_cast<uInt>(block.size());
+    zs.next_out = reinterpret_cast<Bytef *>(&compressed[0u]);
+    zs.avail_out = static_cast<uInt>(compressed.size());
+    int const r = deflate(&zs, Z_FINISH);
+    std::size_t const compressedSize = zs.total_out;
+    deflateEnd(&zs);
+
+    if (r != Z_STREAM_END) {
+        m_logger.error() << "Compressing a block of profiler log file '"
+                         << m_segmentName << "' failed!";
+        return;
+    }
+
+    writeData(compressed.data(), compressedSize);
+}
+
+void ExecutionProfilerLogWriter::writeData(const char * data, std::size_t size)
+{
+    while (size > 0u) {
+        ssize_t const r = ::write(m_fd, data, size);
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            if (!m_writeFailed) {
+                m_logger.error() << "Writing profiler log file '"
+                                 << m_segmentName << "' failed: "
+                                 << std::strerror(errno);
+                m_writeFailed = true;
+            }
+            return;
+        }
+        data += r;
+        size -= static_cast<std::size_t>(r);
+        m_segmentSize += static_cast<std::uint64_t>(r);
+    }
+}
+
+void ExecutionProfilerLogWriter::closeSegment() noexcept {
+    if (m_fd < 0)
+        return;
+
+    m_logger.debug() << "Closing profiler log file '" << m_segmentName
+                     << "'";
+    ::close(m_fd);
+    m_fd = -1;
+}
+
+} // namespace sharemind {
@@ -0,0 +1,267 @@
+/*
+ * Copyright (C) 2015 Cybernetica
+ *
+ * Research/Commercial License Usage
+ * Licensees holding a valid Research License or Commercial License
+ * for the Software may use this file according to the written
+ * agreement between you and Cybernetica.
+ *
+ * GNU General Public License Usage
+ * Alternatively, this file may be used under the terms of the GNU
+ * General Public License version 3.0 as published by the Free Software
+ * Foundation and appearing in the file LICENSE.GPL included in the
+ * packaging of this file.  Please review the following information to
+ * ensure the GNU General Public License version 3.0 requirements will be
+ * met: http://www.gnu.org/copyleft/gpl-3.0.html.
+ *
+ * For further information, please contact us at sharemind@cyber.ee.
+ */
+
+
+#ifndef SHAREMIND_EXECUTIONPROFILERLOGWRITER_H
+#define SHAREMIND_EXECUTIONPROFILERLOGWRITER_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <LogHard/Logger.h>
+#include <mutex>
+#include <ostream>
+#include <sharemind/MicrosecondTime.h>
+#include <streambuf>
+#include <string>
+#include <thread>
+
+
+namespace sharemind {
+
+/** Options for writing profiling logs. */
+struct ExecutionProfilerLogOptions {
+
+    /**
+     Whether to gzip-compress the log. Every block is compressed as a separate
+     gzip member, hence the resulting files can be read by standard tools.
+    */
+    bool compress = false;
+
+    /** The number of bytes buffered before a block is handed to be written */
+    std::size_t blockSize = 64u * 1024u;
+
+    /**
+     The maximum number of blocks waiting to be written. If writing can not
+     keep up, further blocks are dropped instead of using more memory.
+    */
+    std::size_t maxQueuedBlocks = 16u;
+
+    /**
+     If non-zero, a new log segment is started once the current segment has
+     reached this many bytes on disk.
+    */
+    std::uint64_t maxSegmentSize = 0u;
+
+    /**
+     If non-zero, a new log segment is started once the current segment has
+     been open for this many seconds.
+    */
+    std::uint32_t maxSegmentSeconds = 0u;
+
+    /**
+     If non-zero and rotation is enabled, the oldest segment is removed when
+     starting a new segment would otherwise leave more segments than this.
+    */
+    std::uint32_t maxSegments = 0u;
+
+};
+
+/**
+ Writes profiling logs in blocks using a background thread.
+
+ Records are formatted into the current block, which is handed to a background
+ thread once full. The background thread optionally compresses the block and
+ appends it to the current log segment, so that the next block can be filled
+ meanwhile. If rotation is enabled, log segments are named by appending a
+ segment number to the file name, and segments left over from an earlier log
+ with the same name are removed when the log is opened. The number of segments
+ kept can be limited with ExecutionProfilerLogOptions::maxSegments. Every
+ segment begins
+ with the header line, and segments are only started at block boundaries, so
+ each segment can be decoded independently.
+
+ This class is used internally by ExecutionProfiler.
+*/
+class ExecutionProfilerLogWriter {
+
+private: /* Types: */
+
+    class BlockBuffer: public std::streambuf {
+
+    public: /* Methods: */
+
+        std::string & block() noexcept { return m_block; }
+
+    protected: /* Methods: */
+
+        int_type overflow(int_type c) override;
+        std::streamsize xsputn(const char * s, std::streamsize n) override;
+
+    private: /* Fields: */
+
+        std::string m_block;
+
+    };
+
+public: /* Methods: */
+
+    ExecutionProfilerLogWriter(const LogHard::Logger & logger)
+        : m_logger(logger, "[ExecutionProfilerLogWriter]")
+        , m_stream(&m_buffer)
+    {}
+
+    inline ~ExecutionProfilerLogWriter() noexcept { close(); }
+
+    /**
+     Opens the first log segment and starts the background thread.
+
+     \param[in] filename the name of the log file
+     \param[in] header the header line written at the start of every segment
+     \param[in] options the options for writing the log
+     \returns whether opening the log was successful
+    */
+    bool open(const std::string & filename,
+              const std::string & header,
+              const ExecutionProfilerLogOptions & options);
+
+    /** Writes the remaining records, stops the background thread and closes
+        the log, if open. */
+    void close() noexcept;
+
+    inline bool isOpen() const noexcept { return m_thread.joinable(); }
+
+    /**
+     Writes the records not yet written to the log without allocating memory
+     or waiting for locks, e.g. from a signal handler.
+
+     The blocks queued for the background thread are only included if the
+     queue can be locked without waiting. The records are written directly to
+     the log file if it is uncompressed and the background thread is not
+     writing to it at the moment. Otherwise, they are passed uncompressed to
+     the fallback, e.g. to be written to an emergency file. The records are
+     removed from the blocks, so they are not written again later.
+
+     \param[in] fallback called with a pointer to and the size of complete
+                         records separated by newlines.
+    */
+    template <class Fallback>
+    void emergencyFlush(Fallback fallback) noexcept {
+        std::unique_lock<std::mutex> lock(m_queueMutex, std::try_to_lock);
+
+        // Write to the log only while it is not written to otherwise:
+        bool const toLog = lock.owns_lock()
+                           && !m_writing
+                           && m_fd >= 0
+                           && !m_options.compress;
+        if (lock.owns_lock())
+            for (std::string & block : m_queue)
+                emergencyWrite(block, toLog, fallback);
+        emergencyWrite(m_buffer.block(), toLog, fallback);
+    }
+
+    /** Locks the state shared with the background thread before fork(). */
+    inline void prepareFork() noexcept { m_queueMutex.lock(); }
+
+    /** Unlocks the state locked by prepareFork() in the parent process. */
+    inline void parentAfterFork() noexcept { m_queueMutex.unlock(); }
+
+    /**
+     Drops all state inherited from the parent process after fork(), in which
+     the background thread does not exist. Records not yet written by the
+     parent are discarded and the log file is closed without writing to it.
+    */
+    void resetAfterFork() noexcept;
+
+    /** \returns the stream to format the next record into. */
+    inline std::ostream & stream() noexcept { return m_stream; }
+
+    /**
+     Completes the record formatted into stream() and hands the current block
+     to the background thread if it is full.
+    */
+    inline void endRecord() {
+        if (m_buffer.block().size() >= m_options.blockSize)
+            handOffBlock();
+    }
+
+    /**
+     Hands the records formatted so far to the background thread, even if the
+     current block is not full. If the queue of blocks is full, the records
+     are kept in the current block instead, to be written with it later.
+    */
+    void flush();
+
+private: /* Methods: */
+
+    template <class Fallback>
+    void emergencyWrite(std::string & block,
+                        bool toLog,
+                        Fallback & fallback) noexcept
+    {
+        if (toLog) {
+            writeAll(m_fd, block.data(), block.size());
+        } else if (!block.empty()) {
+            fallback(block.data(), block.size());
+        }
+
+        // Clearing keeps the capacity, hence does not deallocate:
+        block.clear();
+    }
+
+    static void writeAll(int fd, const char * data, std::size_t size) noexcept;
+
+    inline bool isRotating() const noexcept {
+        return m_options.maxSegmentSize > 0u
+               || m_options.maxSegmentSeconds > 0u;
+    }
+
+    void handOffBlock(bool force = false);
+    void run();
+    bool openSegment();
+    void writeBlock(const std::string & block);
+    void writeData(const char * data, std::size_t size);
+    void closeSegment() noexcept;
+
+private: /* Fields: */
+
+    const LogHard::Logger m_logger;
+
+    std::string m_filename;
+    std::string m_header;
+    ExecutionProfilerLogOptions m_options;
+
+    BlockBuffer m_buffer;
+    std::ostream m_stream;
+
+    /** The state shared with the background thread */
+    std::mutex m_queueMutex;
+    std::condition_variable m_queueCondition;
+    std::deque<std::string> m_queue;
+    bool m_stop = false;
+    bool m_writing = false;
+    std::thread m_thread;
+
+    /** The number of blocks dropped because the queue was full */
+    std::uint64_t m_droppedBlocks = 0u;
+
+    /** The state of the background thread */
+    std::string m_segmentName;
+    int m_fd = -1;
+    std::uint64_t m_segmentNumber = 0u;
+    std::uint64_t m_segmentSize = 0u;
+    UsTime m_segmentStartTime = 0u;
+    bool m_writeFailed = false;
+
+};
+
+} /* namespace sharemind { */
+
+#endif /* SHAREMIND_EXECUTIONPROFILERLOGWRITER_H */
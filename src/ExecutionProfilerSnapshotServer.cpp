@@ -0,0 +1,290 @@
+/*
+ * Copyright (C) 2015 Cybernetica
+ *
+ * Research/Commercial License Usage
+ * Licensees holding a valid Research License or Commercial License
+ * for the Software may use this file according to the written
+ * agreement between you and Cybernetica.
+ *
+ * GNU General Public License Usage
+ * Alternatively, this file may be used under the terms of the GNU
+ * General Public License version 3.0 as published by the Free Software
+ * Foundation and appearing in the file LICENSE.GPL included in the
+ * packaging of this file.  Please review the following information to
+ * ensure the GNU General Public License version 3.0 requirements will be
+ * met: http://www.gnu.org/copyleft/gpl-3.0.html.
+ *
+ * For further information, please contact us at sharemind@cyber.ee.
+ */
+
+
+#include "ExecutionProfilerSnapshotServer.h"
+
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <poll.h>
+#include <sharemind/MicrosecondTime.h>
+#include <sstream>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+
+namespace {
+
+inline void closeFd(int & fd) noexcept {
+    if (fd >= 0) {
+        ::close(fd);
+        fd = -1;
+    }
+}
+
+/** The time a client is given to receive a snapshot, in microseconds */
+constexpr sharemind::UsTime sendTimeout = 5000000u;
+
+/** The time to back off for when accepting clients fails, in milliseconds */
+constexpr int acceptBackoff = 100;
+
+/**
+ Sends all the given data to a non-blocking socket, giving up when the send
+ timeout expires or the stop pipe becomes readable.
+*/
+inline bool sendAll(int fd, int stopFd, const char * data, std::size_t size)
+        noexcept
+{
+    sharemind::UsTime const deadline = sharemind::getUsTime() + sendTimeout;
+    while (size > 0u) {
+        ssize_t const r = ::send(fd, data, size, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (r >= 0) {
+            data += r;
+            size -= static_cast<std::size_t>(r);
+            continue;
+        }
+
+        if (errno == EINTR)
+            continue;
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            return false;
+
+        sharemind::UsTime const now = sharemind::getUsTime();
+        if (now >= deadline) {
+            errno = ETIMEDOUT;
+            return false;
+        }
+
+        pollfd fds[2];
+        fds[0].fd = fd;
+        fds[0].events = POLLOUT;
+        fds[1].fd = stopFd;
+        fds[1].events = POLLIN;
+        int const timeoutMs =
+                static_cast<int>((deadline - now + 999u) / 1000u);
+        if (::poll(fds, 2u, timeoutMs) < 0 && errno != EINTR)
+            return false;
+        if (fds[1].revents != 0) {
+            errno = ECANCELED;
+            return false;
+        }
+    }
+    return true;
+}
+
+}
+
+namespace sharemind {
+
+void writeExecutionProfilerSnapshot(std::ostream & os,
+                                    const ExecutionProfilerSnapshot & snapshot)
+{
+    os << "Snapshot;Time;PendingSections;OpenSections\n"
+       << "Snapshot;" << snapshot.time
+       << ';' << snapshot.pendingSections
+       << ';' << snapshot.openSections.size() << '\n';
+
+    os << "Type;Name;Count;TotalDuration;MinDuration;MaxDuration"
+          ";TotalSuspendedTime;TotalSegments;TotalComplexity"
+          ";TotalAllocatedBytes;TotalAllocations;MaxPeakLiveBytes"
+          ";DurationSlope;DurationIntercept;DurationResidualStdDev;Outliers"
+          #ifdef SHAREMIND_NETWORK_STATISTICS_ENABLE
+          ";BytesSlope;BytesIntercept;BytesResidualStdDev"
+          #endif
+          ;
+    for (std::size_t i = 0u; i < executionWaitReasonCount; ++i)
+        os << ";Wait"
+           << executionWaitReasonName(static_cast<ExecutionWaitReason>(i));
+    os << '\n';
+    for (auto const & type : snapshot.sectionTypeStatistics) {
+        ExecutionSectionTypeStatistics const & stats = type.second;
+        os << "Type;" << type.first
+           << ';' << stats.count
+           << ';' << stats.totalDuration
+           << ';' << stats.minDuration
+           << ';' << stats.maxDuration
+           << ';' << stats.totalSuspendedTime
+           << ';' << stats.totalSegmentCount
+           << ';' << stats.totalComplexity
+           << ';' << stats.totalAllocatedBytes
+           << ';' << stats.totalAllocationCount
+           << ';' << stats.maxPeakLiveBytes
+           << ';' << stats.durationModel.slope()
+           << ';' << stats.durationModel.intercept()
+           << ';' << stats.durationModel.residualStdDev()
+           << ';' << stats.outlierCount
+           #ifdef SHAREMIND_NETWORK_STATISTICS_ENABLE
+           << ';' << stats.bytesModel.slope()
+           << ';' << stats.bytesModel.intercept()
+           << ';' << stats.bytesModel.residualStdDev()
+           #endif
+           ;
+        for (ExecutionWaitStatistics const & wait : stats.waits)
+            os << ';' << wait.totalTime;
+        os << '\n';
+    }
+
+    os << "PeerWait;Name;Peer;Count;TotalTime\n";
+    for (auto const & type : snapshot.sectionTypeStatistics)
+        for (auto const & peer : type.second.networkReceiveWaitsByPeer)
+            os << "PeerWait;" << type.first
+               << ';' << peer.first
+               << ';' << peer.second.count
+               << ';' << peer.second.totalTime << '\n';
+
+    os << "Open;Name;SectionID;ParentSectionID;Age;Complexity;SuspendedTime"
+          ";Suspended\n";
+    for (auto const & section : snapshot.openSections)
+        os << "Open;" << section.name
+           << ';' << section.sectionId
+           << ';' << section.parentSectionId
+           << ';' << section.age
+           << ';' << section.complexityParameter
+           << ';' << section.suspendedTime
+           << ';' << (section.suspended ? 1 : 0) << '\n';
+}
+
+bool ExecutionProfilerSnapshotServer::start(const std::string & socketPath,
+                                            mode_t socketMode)
+{
+    assert(!socketPath.empty());
+    assert(m_listenFd < 0);
+
+    sockaddr_un address;
+    std::memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (socketPath.size() >= sizeof(address.sun_path)) {
+        m_logger.error() << "Socket path '" << socketPath << "' is too long!";
+        return false;
+    }
+    std::memcpy(address.sun_path, socketPath.c_str(), socketPath.size() + 1u);
+
+    m_listenFd = ::socket(AF_UNIX,
+                          SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                          0);
+    if (m_listenFd < 0) {
+        m_logger.error() << "Can not create snapshot socket: "
+                         << std::strerror(errno);
+        return false;
+    }
+
+    // Clients can not connect before listen(), hence the socket file mode can
+    // be set between bind() and listen() without exposing the socket:
+    ::unlink(socketPath.c_str());
+    if (::bind(m_listenFd,
+               reinterpret_cast<const sockaddr *>(&address),
+               sizeof(address)) != 0
+        || ::chmod(socketPath.c_str(), socketMode) != 0
+        || ::listen(m_listenFd, 4) != 0)
+    {
+        m_logger.error() << "Can not listen on snapshot socket '"
+                         << socketPath << "': " << std::strerror(errno);
+        closeFd(m_listenFd);
+        return false;
+    }
+    m_socketPath = socketPath;
+
+    if (::pipe2(m_stopPipe, O_CLOEXEC) != 0) {
+        m_logger.error() << "Can not create snapshot server pipe: "
+                         << std::strerror(errno);
+        stop();
+        return false;
+    }
+
+    m_thread = std::thread(&ExecutionProfilerSnapshotServer::serve, this);
+
+    m_logger.debug() << "Serving profiler snapshots on '" << m_socketPath
+                     << "'.";
+    return true;
+}
+
+void ExecutionProfilerSnapshotServer::stop() noexcept {
+    if (m_thread.joinable()) {
+        char const c = 0;
+        while (::write(m_stopPipe[1], &c, 1u) < 0 && errno == EINTR) {}
+        m_thread.join();
+    }
+
+    closeFd(m_stopPipe[0]);
+    closeFd(m_stopPipe[1]);
+
+    if (m_listenFd >= 0) {
+        closeFd(m_listenFd);
+        ::unlink(m_socketPath.c_str());
+        m_socketPath.clear();
+    }
+}
+
+void ExecutionProfilerSnapshotServer::serve() {
+    for (;;) {
+        pollfd fds[2];
+        fds[0].fd = m_listenFd;
+        fds[0].events = POLLIN;
+        fds[1].fd = m_stopPipe[0];
+        fds[1].events = POLLIN;
+
+        if (::poll(fds, 2u, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            m_logger.error() << "Polling snapshot socket failed: "
+                             << std::strerror(errno);
+            return;
+        }
+
+        if (fds[1].revents != 0)
+            return;
+
+        if (fds[0].revents == 0)
+            continue;
+
+        int clientFd = ::accept4(m_listenFd,
+                                 nullptr,
+                                 nullptr,
+                                 SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (clientFd < 0) {
+            if (errno == EMFILE || errno == ENFILE
+                || errno == ENOBUFS || errno == ENOMEM)
+            {
+                // The pending connection stays pending, so back off instead
+                // of spinning until resources become available:
+                m_logger.warning() << "Accepting snapshot client failed: "
+                                   << std::strerror(errno);
+                pollfd stopFd;
+                stopFd.fd = m_stopPipe[0];
+                stopFd.events = POLLIN;
+                ::poll(&stopFd, 1u, acceptBackoff);
+            }
+            continue;
+        }
+
+        std::ostringstream o;
+        writeExecutionProfilerSnapshot(o, m_profiler.snapshot());
+        std::string const data(o.str());
+        if (!sendAll(clientFd, m_stopPipe[0], data.c_str(), data.size()))
+            m_logger.debug() << "Sending snapshot failed: "
+                             << std::strerror(errno);
+        closeFd(clientFd);
+    }
+}
+
+} // namespace sharemind {
@@ -0,0 +1,112 @@
+/*
+ * Copyright (C) 2015 Cybernetica
+ *
+ * Research/Commercial License Usage
+ * Licensees holding a valid Research License or Commercial License
+ * for the Software may use this file according to the written
+ * agreement between you and Cybernetica.
+ *
+ * GNU General Public License Usage
+ * Alternatively, this file may be used under the terms of the GNU
+ * General Public License version 3.0 as published by the Free Software
+ * Foundation and appearing in the file LICENSE.GPL included in the
+ * packaging of this file.  Please review the following information to
+ * ensure the GNU General Public License version 3.0 requirements will be
+ * met: http://www.gnu.org/copyleft/gpl-3.0.html.
+ *
+ * For further information, please contact us at sharemind@cyber.ee.
+ */
+
+
+#ifndef SHAREMIND_EXECUTIONPROFILERSNAPSHOTSERVER_H
+#define SHAREMIND_EXECUTIONPROFILERSNAPSHOTSERVER_H
+
+#include <LogHard/Logger.h>
+#include <ostream>
+#include <string>
+#include <sys/stat.h>
+#include <thread>
+#include "ExecutionProfiler.h"
+
+
+namespace sharemind {
+
+/**
+ Writes the given snapshot in a semicolon-separated text format.
+
+ The output consists of a "Snapshot" line followed by one "Type" line per
+ section type, one "PeerWait" line per section type and peer waited for and
+ one "Open" line per open section, each preceded by a line naming its
+ columns.
+
+ \param[in] os the stream to write the snapshot to
+ \param[in] snapshot the snapshot to write
+*/
+void writeExecutionProfilerSnapshot(std::ostream & os,
+                                    const ExecutionProfilerSnapshot & snapshot);
+
+/**
+ Serves snapshots of an ExecutionProfiler over a local Unix domain socket.
+
+ Every client connecting to the socket is sent a single snapshot as formatted
+ by writeExecutionProfilerSnapshot, after which the connection is closed. This
+ allows a monitoring agent on the same host to poll a running process for hot
+ spots and stuck sections.
+*/
+class ExecutionProfilerSnapshotServer {
+
+public: /* Methods: */
+
+    ExecutionProfilerSnapshotServer(ExecutionProfiler & profiler,
+                                    const LogHard::Logger & logger)
+        : m_profiler(profiler)
+        , m_logger(logger, "[ExecutionProfilerSnapshotServer]")
+    {}
+
+    inline ~ExecutionProfilerSnapshotServer() noexcept { stop(); }
+
+    /**
+     Starts serving snapshots on the given socket path.
+
+     Any existing file at the given path is removed before binding the
+     socket, and the socket file is removed again by stop(). Clients which do
+     not receive their snapshot within a few seconds are disconnected.
+
+     \param[in] socketPath the file system path of the socket to listen on
+     \param[in] socketMode the file mode of the socket, which controls who
+                           can connect to it
+     \returns whether the socket was successfully set up
+    */
+    bool start(const std::string & socketPath,
+               mode_t socketMode = S_IRUSR | S_IWUSR);
+
+    /** Stops serving snapshots, if started. */
+    void stop() noexcept;
+
+private: /* Methods: */
+
+    void serve();
+
+private: /* Fields: */
+
+    ExecutionProfiler & m_profiler;
+
+    const LogHard::Logger m_logger;
+
+    /** The path of the socket file */
+    std::string m_socketPath;
+
+    /** The listening socket, or -1 if not started */
+    int m_listenFd = -1;
+
+    /** The pipe used to wake up the serving thread on stop() */
+    int m_stopPipe[2] = {-1, -1};
+
+    /** The thread serving the clients */
+    std::thread m_thread;
+
+};
+
+} /* namespace sharemind { */
+
+#endif /* SHAREMIND_EXECUTIONPROFILERSNAPSHOTSERVER_H */
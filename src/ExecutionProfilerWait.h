@@ -0,0 +1,190 @@
+/*
+ * Copyright (C) 2015 Cybernetica
+ *
+ * Research/Commercial License Usage
+ * Licensees holding a valid Research License or Commercial License
+ * for the Software may use this file according to the written
+ * agreement between you and Cybernetica.
+ *
+ * GNU General Public License Usage
+ * Alternatively, this file may be used under the terms of the GNU
+ * General Public License version 3.0 as published by the Free Software
+ * Foundation and appearing in the file LICENSE.GPL included in the
+ * packaging of this file.  Please review the following information to
+ * ensure the GNU General Public License version 3.0 requirements will be
+ * met: http://www.gnu.org/copyleft/gpl-3.0.html.
+ *
+ * For further information, please contact us at sharemind@cyber.ee.
+ */
+
+
+#ifndef SHAREMIND_EXECUTIONPROFILERWAIT_H
+#define SHAREMIND_EXECUTIONPROFILERWAIT_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <sharemind/MicrosecondTime.h>
+#include "ExecutionProfiler.h"
+
+
+namespace sharemind {
+
+/**
+ This class is used to automatically record a wait of an ExecutionProfiler
+ section lasting for as long as an instance of this class is alive.
+*/
+class ExecutionWaitScope {
+
+public:
+    /**
+     Starts timing the wait.
+
+     \param[in] profiler the profiler instance the section was started on
+     \param[in] sectionId the section which waits
+     \param[in] reason the reason the section is blocked for
+     \param[in] peer the peer waited for in case of network receives
+    */
+    ExecutionWaitScope(ExecutionProfiler & profiler,
+                       std::uint32_t sectionId,
+                       ExecutionWaitReason reason,
+                       std::size_t peer = ExecutionProfiler::noPeer)
+        : m_profiler(profiler)
+        , m_sectionId(sectionId)
+        , m_reason(reason)
+        , m_peer(peer)
+        , m_startTime(getUsTime())
+    {}
+
+    ExecutionWaitScope(const ExecutionWaitScope &) = delete;
+    ExecutionWaitScope & operator=(const ExecutionWaitScope &) = delete;
+
+    /**
+     Records the wait
+    */
+    ~ExecutionWaitScope() {
+        m_profiler.recordWait(m_sectionId,
+                              m_reason,
+                              m_startTime,
+                              getUsTime(),
+                              m_peer);
+    }
+
+private:
+    /** Holds the reference to the ExecutionProfiler instance. */
+    ExecutionProfiler & m_profiler;
+
+    /** The identifier of the waiting section. */
+    std::uint32_t const m_sectionId;
+
+    /** The reason the section is blocked for. */
+    ExecutionWaitReason const m_reason;
+
+    /** The peer waited for. */
+    std::size_t const m_peer;
+
+    /** The moment the wait started. */
+    UsTime const m_startTime;
+};
+
+/**
+ Locks the given mutex, recording the time spent waiting for it as mutex
+ contention if it was not immediately available.
+
+ The wait is recorded after the mutex has been locked, hence the mutex is
+ also held while the profiler lock is taken to record it.
+
+ \param[in] profiler the profiler instance the section was started on
+ \param[in] sectionId the section which waits
+ \param[in] mutex the mutex to lock
+ \returns the lock owning the mutex
+*/
+template <class Mutex>
+std::unique_lock<Mutex> profiledLock(ExecutionProfiler & profiler,
+                                     std::uint32_t sectionId,
+                                     Mutex & mutex)
+{
+    std::unique_lock<Mutex> lock(mutex, std::try_to_lock);
+    if (!lock.owns_lock()) {
+        UsTime const startTime = getUsTime();
+        lock.lock();
+        profiler.recordWait(sectionId,
+                            ExecutionWaitReason::MutexContention,
+                            startTime,
+                            getUsTime());
+    }
+    return lock;
+}
+
+/**
+ Waits on the given condition variable until the predicate is satisfied,
+ recording the time spent waiting if the predicate was not satisfied already.
+
+ Since the caller expects to hold the lock on return, the wait is recorded
+ while still holding it. Recording takes the profiler lock, hence under
+ contention on the profiler lock other threads waiting for the mutex of the
+ given lock are delayed as well.
+
+ \param[in] profiler the profiler instance the section was started on
+ \param[in] sectionId the section which waits
+ \param[in] condition the condition variable to wait on
+ \param[in] lock the lock to wait with
+ \param[in] predicate the predicate to wait for
+ \param[in] reason the reason the section is blocked for
+*/
+template <class Predicate>
+void profiledWait(ExecutionProfiler & profiler,
+                  std::uint32_t sectionId,
+                  std::condition_variable & condition,
+                  std::unique_lock<std::mutex> & lock,
+                  Predicate predicate,
+                  ExecutionWaitReason reason = ExecutionWaitReason::QueuePop)
+{
+    if (predicate())
+        return;
+
+    UsTime const startTime = getUsTime();
+    condition.wait(lock, predicate);
+    profiler.recordWait(sectionId, reason, startTime, getUsTime());
+}
+
+/**
+ Waits on the given condition variable until the predicate is satisfied or
+ the timeout expires, recording the time spent waiting if the predicate was
+ not satisfied already.
+
+ Like profiledWait, this takes the profiler lock while holding the given
+ lock.
+
+ \param[in] profiler the profiler instance the section was started on
+ \param[in] sectionId the section which waits
+ \param[in] condition the condition variable to wait on
+ \param[in] lock the lock to wait with
+ \param[in] timeout the maximum duration to wait for
+ \param[in] predicate the predicate to wait for
+ \param[in] reason the reason the section is blocked for
+ \returns the value of the predicate after waiting
+*/
+template <class Rep, class Period, class Predicate>
+bool profiledWaitFor(ExecutionProfiler & profiler,
+                     std::uint32_t sectionId,
+                     std::condition_variable & condition,
+                     std::unique_lock<std::mutex> & lock,
+                     const std::chrono::duration<Rep, Period> & timeout,
+                     Predicate predicate,
+                     ExecutionWaitReason reason = ExecutionWaitReason::QueuePop)
+{
+    if (predicate())
+        return true;
+
+    UsTime const startTime = getUsTime();
+    bool const r = condition.wait_for(lock, timeout, predicate);
+    profiler.recordWait(sectionId, reason, startTime, getUsTime());
+    return r;
+}
+
+} /* namespace sharemind { */
+
+#endif /* SHAREMIND_EXECUTIONPROFILERWAIT_H */
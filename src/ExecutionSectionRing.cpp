@@ -0,0 +1,297 @@
+/*
+ * Copyright (C) 2015 Cybernetica
+ *
+ * Research/Commercial License Usage
+ * Licensees holding a valid Research License or Commercial License
+ * for the Software may use this file according to the written
+ * agreement between you and Cybernetica.
+ *
+ * GNU General Public License Usage
+ * Alternatively, this file may be used under the terms of the GNU
+ * General Public License version 3.0 as published by the Free Software
+ * Foundation and appearing in the file LICENSE.GPL included in the
+ * packaging of this file.  Please review the following information to
+ * ensure the GNU General Public License version 3.0 requirements will be
+ * met: http://www.gnu.org/copyleft/gpl-3.0.html.
+ *
+ * For further information, please contact us at sharemind@cyber.ee.
+ */
+
+
+#include "ExecutionSectionRing.h"
+
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <new>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+namespace {
+
+constexpr std::size_t headerSize =
+        (sizeof(sharemind::ExecutionSectionRingHeader) + 63u) & ~std::size_t(63u);
+
+inline std::size_t regionSize(std::uint32_t capacity,
+                              std::uint32_t nameCapacity,
+                              std::uint32_t nameSize) noexcept
+{
+    std::size_t const namesSize =
+            (std::size_t(nameCapacity) * nameSize + 63u) & ~std::size_t(63u);
+    return headerSize + namesSize
+           + std::size_t(capacity) * sizeof(sharemind::ExecutionSectionRingRecord);
+}
+
+inline std::uint32_t roundUpToPowerOfTwo(std::uint32_t v) noexcept {
+    std::uint32_t r = 1u;
+    while (r < v)
+        r <<= 1u;
+    return r;
+}
+
+}
+
+namespace sharemind {
+
+constexpr std::uint32_t ExecutionSectionRingHeader::magicValue;
+constexpr std::uint32_t ExecutionSectionRingHeader::currentVersion;
+constexpr std::size_t ExecutionSectionRingRecord::maxAttributes;
+constexpr std::size_t ExecutionSectionRingRecord::waitReasonCount;
+constexpr std::uint32_t ExecutionSectionRing::noNameIndex;
+
+bool ExecutionSectionRing::open(const std::string & name,
+                                std::uint32_t capacity,
+                                std::uint32_t nameCapacity,
+                                std::uint32_t nameSize)
+{
+    assert(!name.empty());
+    assert(capacity > 0u && capacity <= (UINT32_MAX / 2u) + 1u);
+    assert(nameSize > 0u);
+
+    close();
+
+    capacity = roundUpToPowerOfTwo(capacity);
+    std::size_t const size = regionSize(capacity, nameCapacity, nameSize);
+
+    ::shm_unlink(name.c_str());
+    int const fd = ::shm_open(name.c_str(),
+                              O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC,
+                              S_IRUSR | S_IWUSR);
+    if (fd < 0) {
+        m_logger.error() << "Can not create shared memory object '" << name
+                         << "': " << std::strerror(errno);
+        return false;
+    }
+
+    void * memory = MAP_FAILED;
+    if (::ftruncate(fd, static_cast<off_t>(size)) == 0)
+        memory = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    int const error = errno;
+    ::close(fd);
+    if (memory == MAP_FAILED) {
+        m_logger.error() << "Can not map shared memory object '" << name
+                         << "': " << std::strerror(error);
+        ::shm_unlink(name.c_str());
+        return false;
+    }
+
+    m_name = name;
+    m_memory = memory;
+    m_size = size;
+    m_names = static_cast<char *>(memory) + headerSize;
+    m_records = reinterpret_cast<ExecutionSectionRingRecord *>(
+                    static_cast<char *>(memory)
+                    + (size - capacity * sizeof(ExecutionSectionRingRecord)));
+
+    ExecutionSectionRingHeader * const h =
+            new (memory) ExecutionSectionRingHeader();
+    h->version = ExecutionSectionRingHeader::currentVersion;
+    h->recordSize = sizeof(ExecutionSectionRingRecord);
+    h->capacity = capacity;
+    h->nameCapacity = nameCapacity;
+    h->nameSize = nameSize;
+    h->writeIndex.store(0u, std::memory_order_relaxed);
+    h->readIndex.store(0u, std::memory_order_relaxed);
+    h->droppedRecords.store(0u, std::memory_order_relaxed);
+    h->nameCount.store(0u, std::memory_order_relaxed);
+
+    // Publish the magic last, so consumers never see a partial header:
+    h->magic.store(ExecutionSectionRingHeader::magicValue,
+                   std::memory_order_release);
+    m_header = h;
+
+    m_logger.debug() << "Opened shared memory section ring '" << m_name
+                     << "' of " << capacity << " records.";
+    return true;
+}
+
+void ExecutionSectionRing::close() noexcept {
+    if (!m_header)
+        return;
+
+    ::munmap(m_memory, m_size);
+    ::shm_unlink(m_name.c_str());
+    m_memory = nullptr;
+    m_size = 0u;
+    m_header = nullptr;
+    m_names = nullptr;
+    m_records = nullptr;
+}
+
+void ExecutionSectionRing::resetAfterFork() noexcept {
+    if (!m_header)
+        return;
+
+    ::munmap(m_memory, m_size);
+    m_memory = nullptr;
+    m_size = 0u;
+    m_header = nullptr;
+    m_names = nullptr;
+    m_records = nullptr;
+}
+
+std::uint32_t ExecutionSectionRing::addName(const char * name) noexcept {
+    assert(m_header);
+    assert(name);
+
+    std::uint32_t const index =
+            m_header->nameCount.load(std::memory_order_relaxed);
+    if (index >= m_header->nameCapacity)
+        return noNameIndex;
+
+    char * const entry = m_names + std::size_t(index) * m_header->nameSize;
+    std::strncpy(entry, name, m_header->nameSize - 1u);
+    entry[m_header->nameSize - 1u] = '\0';
+
+    m_header->nameCount.store(index + 1u, std::memory_order_release);
+    return index;
+}
+
+bool ExecutionSectionRing::publish(const ExecutionSectionRingRecord & record)
+        noexcept
+{
+    assert(m_header);
+
+    std::uint64_t const w = m_header->writeIndex.load(std::memory_order_relaxed);
+    std::uint64_t const r = m_header->readIndex.load(std::memory_order_acquire);
+    if (w - r >= m_header->capacity) {
+        m_header->droppedRecords.fetch_add(1u, std::memory_order_relaxed);
+        return false;
+    }
+
+    m_records[w & (m_header->capacity - 1u)] = record;
+    m_header->writeIndex.store(w + 1u, std::memory_order_release);
+    return true;
+}
+
+std::uint64_t ExecutionSectionRing::droppedRecords() const noexcept {
+    assert(m_header);
+    return m_header->droppedRecords.load(std::memory_order_relaxed);
+}
+
+bool ExecutionSectionRingReader::open(const std::string & name) {
+    assert(!name.empty());
+    assert(!m_header);
+
+    int const fd = ::shm_open(name.c_str(), O_RDWR | O_CLOEXEC, 0);
+    if (fd < 0) {
+        m_logger.error() << "Can not open shared memory object '" << name
+                         << "': " << std::strerror(errno);
+        return false;
+    }
+
+    struct stat st;
+    void * memory = MAP_FAILED;
+    if (::fstat(fd, &st) == 0
+        && static_cast<std::size_t>(st.st_size) >= headerSize)
+        memory = ::mmap(nullptr,
+                        static_cast<std::size_t>(st.st_size),
+                        PROT_READ | PROT_WRITE,
+                        MAP_SHARED,
+                        fd,
+                        0);
+    int const error = errno;
+    ::close(fd);
+    if (memory == MAP_FAILED) {
+        m_logger.error() << "Can not map shared memory object '" << name
+                         << "': " << std::strerror(error);
+        return false;
+    }
+
+    std::size_t const size = static_cast<std::size_t>(st.st_size);
+    const ExecutionSectionRingHeader * const h =
+            static_cast<const ExecutionSectionRingHeader *>(memory);
+    if (h->magic.load(std::memory_order_acquire)
+            != ExecutionSectionRingHeader::magicValue
+        || h->version != ExecutionSectionRingHeader::currentVersion
+        || h->recordSize != sizeof(ExecutionSectionRingRecord)
+        || h->capacity == 0u
+        || (h->capacity & (h->capacity - 1u)) != 0u
+        || h->nameSize == 0u
+        || regionSize(h->capacity, h->nameCapacity, h->nameSize) != size)
+    {
+        m_logger.error() << "Shared memory object '" << name
+                         << "' is not a compatible section ring!";
+        ::munmap(memory, size);
+        return false;
+    }
+
+    m_memory = memory;
+    m_size = size;
+    m_header = h;
+    m_names = static_cast<const char *>(memory) + headerSize;
+    m_records = reinterpret_cast<const ExecutionSectionRingRecord *>(
+                    static_cast<const char *>(memory)
+                    + (size - h->capacity * sizeof(ExecutionSectionRingRecord)));
+    return true;
+}
+
+void ExecutionSectionRingReader::close() noexcept {
+    if (!m_header)
+        return;
+
+    ::munmap(m_memory, m_size);
+    m_memory = nullptr;
+    m_size = 0u;
+    m_header = nullptr;
+    m_names = nullptr;
+    m_records = nullptr;
+}
+
+bool ExecutionSectionRingReader::pop(ExecutionSectionRingRecord & record)
+        noexcept
+{
+    assert(m_header);
+
+    // The consumer index is only written by us, but lives in shared memory:
+    ExecutionSectionRingHeader * const h =
+            const_cast<ExecutionSectionRingHeader *>(m_header);
+    std::uint64_t const r = h->readIndex.load(std::memory_order_relaxed);
+    std::uint64_t const w = h->writeIndex.load(std::memory_order_acquire);
+    if (r == w)
+        return false;
+
+    record = m_records[r & (h->capacity - 1u)];
+    h->readIndex.store(r + 1u, std::memory_order_release);
+    return true;
+}
+
+const char * ExecutionSectionRingReader::name(std::uint32_t nameIndex) const
+        noexcept
+{
+    assert(m_header);
+
+    if (nameIndex >= m_header->nameCount.load(std::memory_order_acquire))
+        return nullptr;
+    return m_names + std::size_t(nameIndex) * m_header->nameSize;
+}
+
+std::uint64_t ExecutionSectionRingReader::droppedRecords() const noexcept {
+    assert(m_header);
+    return m_header->droppedRecords.load(std::memory_order_relaxed);
+}
+
+} // namespace sharemind {
@@ -0,0 +1,298 @@
+/*
+ * Copyright (C) 2015 Cybernetica
+ *
+ * Research/Commercial License Usage
+ * Licensees holding a valid Research License or Commercial License
+ * for the Software may use this file according to the written
+ * agreement between you and Cybernetica.
+ *
+ * GNU General Public License Usage
+ * Alternatively, this file may be used under the terms of the GNU
+ * General Public License version 3.0 as published by the Free Software
+ * Foundation and appearing in the file LICENSE.GPL included in the
+ * packaging of this file.  Please review the following information to
+ * ensure the GNU General Public License version 3.0 requirements will be
+ * met: http://www.gnu.org/copyleft/gpl-3.0.html.
+ *
+ * For further information, please contact us at sharemind@cyber.ee.
+ */
+
+
+#ifndef SHAREMIND_EXECUTIONSECTIONRING_H
+#define SHAREMIND_EXECUTIONSECTIONRING_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <LogHard/Logger.h>
+#include <string>
+
+
+namespace sharemind {
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2 && ATOMIC_INT_LOCK_FREE == 2,
+              "Shared memory rings require lock-free atomics!");
+
+/**
+ The header at the beginning of the shared memory region of an
+ ExecutionSectionRing.
+
+ The header is followed by the name table of nameCapacity entries of nameSize
+ bytes each, which is followed by the ring of capacity records. The producer
+ only publishes a record after publishing the name it refers to.
+*/
+struct ExecutionSectionRingHeader {
+
+    static constexpr std::uint32_t magicValue = 0x50454d53u; // "SMEP"
+    static constexpr std::uint32_t currentVersion = 1u;
+
+    /** Set to magicValue once the rest of the header is initialized */
+    std::atomic<std::uint32_t> magic;
+    std::uint32_t version;
+
+    /** The size of a single ExecutionSectionRingRecord */
+    std::uint32_t recordSize;
+
+    /** The number of records in the ring, a power of two */
+    std::uint32_t capacity;
+
+    /** The number of entries in the name table */
+    std::uint32_t nameCapacity;
+
+    /** The size of a single name table entry, including the terminator */
+    std::uint32_t nameSize;
+
+    /** The total number of records published by the producer */
+    alignas(64) std::atomic<std::uint64_t> writeIndex;
+
+    /** The total number of records consumed by the consumer */
+    alignas(64) std::atomic<std::uint64_t> readIndex;
+
+    /** The number of records the producer dropped because the ring was full */
+    alignas(64) std::atomic<std::uint64_t> droppedRecords;
+
+    /** The number of published name table entries */
+    std::atomic<std::uint32_t> nameCount;
+
+};
+
+/** An attribute of a section as stored in an ExecutionSectionRing. */
+struct ExecutionSectionRingAttribute {
+
+    /** The name table index of the attribute key */
+    std::uint32_t keyIndex;
+
+    /** Zero for integer values, one for string values */
+    std::uint32_t isString;
+
+    /** The integer value, or the name table index of the string value */
+    std::int64_t value;
+
+};
+
+/** Waits of a single reason as stored in an ExecutionSectionRing. */
+struct ExecutionSectionRingWait {
+
+    std::uint64_t count;
+    std::uint64_t totalTime;
+
+};
+
+/** A completed execution section as stored in an ExecutionSectionRing. */
+struct ExecutionSectionRingRecord {
+
+    static constexpr std::size_t maxAttributes = 6u;
+    static constexpr std::size_t waitReasonCount = 5u;
+
+    std::uint32_t sectionId;
+    std::uint32_t parentSectionId;
+
+    /** The name table index of the section type name */
+    std::uint32_t nameIndex;
+
+    /** The number of valid entries in attributes */
+    std::uint32_t attributeCount;
+
+    std::uint64_t startTime;
+    std::uint64_t endTime;
+    std::uint64_t complexityParameter;
+
+    /** The total time the section spent suspended */
+    std::uint64_t suspendedTime;
+
+    /** The number of continuous stretches the section was active in */
+    std::uint32_t segmentCount;
+
+    std::uint32_t reserved;
+
+    /** The bytes and number of allocations within the section */
+    std::uint64_t allocatedBytes;
+    std::uint64_t allocationCount;
+
+    /** The peak number of bytes allocated within the section at once */
+    std::uint64_t peakLiveBytes;
+
+    /**
+     The deviation of the duration from the cost model in residual standard
+     deviations, or zero if the section was not flagged as an outlier
+    */
+    double costModelDeviation;
+
+    /** The waits of the section, indexed by ExecutionWaitReason */
+    ExecutionSectionRingWait waits[waitReasonCount];
+
+    ExecutionSectionRingAttribute attributes[maxAttributes];
+
+};
+
+/**
+ The producer side of a single-producer single-consumer ring of completed
+ execution sections in POSIX shared memory.
+
+ The producer never blocks: if the consumer falls behind and the ring is full,
+ records are dropped and counted in ExecutionSectionRingHeader::droppedRecords.
+*/
+class ExecutionSectionRing {
+
+public: /* Constants: */
+
+    /** The name index used for names which do not fit into the name table */
+    static constexpr std::uint32_t noNameIndex = UINT32_MAX;
+
+public: /* Methods: */
+
+    ExecutionSectionRing(const LogHard::Logger & logger)
+        : m_logger(logger, "[ExecutionSectionRing]")
+    {}
+
+    ExecutionSectionRing(const ExecutionSectionRing &) = delete;
+    ExecutionSectionRing & operator=(const ExecutionSectionRing &) = delete;
+
+    inline ~ExecutionSectionRing() noexcept { close(); }
+
+    /**
+     Creates the shared memory object and maps it.
+
+     Any existing shared memory object with the given name is replaced. If
+     the ring is already open, it is closed first.
+
+     \param[in] name the name of the shared memory object (e.g. "/profiler")
+     \param[in] capacity the number of records in the ring, rounded up to a
+                         power of two
+     \param[in] nameCapacity the number of entries in the name table
+     \param[in] nameSize the size of a name table entry, longer names are
+                         truncated
+     \returns whether the shared memory object was successfully set up
+    */
+    bool open(const std::string & name,
+                     std::uint32_t capacity,
+                     std::uint32_t nameCapacity,
+                     std::uint32_t nameSize);
+
+    /** Unmaps and unlinks the shared memory object, if open. */
+    void close() noexcept;
+
+    /**
+     Unmaps the shared memory object without unlinking it. This is used in a
+     child process after fork(), as the ring has a single producer which
+     remains the parent.
+    */
+    void resetAfterFork() noexcept;
+
+    inline bool isOpen() const noexcept { return m_header; }
+
+    /**
+     Publishes a name into the name table.
+
+     \param[in] name the name to publish
+     \returns the index of the name in the name table, or noNameIndex if the
+              name table is full.
+    */
+    std::uint32_t addName(const char * name) noexcept;
+
+    /**
+     Publishes a record into the ring.
+
+     \param[in] record the record to publish
+     \returns false if the ring was full and the record was dropped.
+    */
+    bool publish(const ExecutionSectionRingRecord & record) noexcept;
+
+    /** \returns the number of records dropped so far. */
+    std::uint64_t droppedRecords() const noexcept;
+
+private: /* Fields: */
+
+    const LogHard::Logger m_logger;
+
+    std::string m_name;
+    void * m_memory = nullptr;
+    std::size_t m_size = 0u;
+    ExecutionSectionRingHeader * m_header = nullptr;
+    char * m_names = nullptr;
+    ExecutionSectionRingRecord * m_records = nullptr;
+
+};
+
+/**
+ The consumer side of an ExecutionSectionRing, for use in a separate process.
+*/
+class ExecutionSectionRingReader {
+
+public: /* Methods: */
+
+    ExecutionSectionRingReader(const LogHard::Logger & logger)
+        : m_logger(logger, "[ExecutionSectionRingReader]")
+    {}
+
+    ExecutionSectionRingReader(const ExecutionSectionRingReader &) = delete;
+    ExecutionSectionRingReader & operator=(const ExecutionSectionRingReader &)
+            = delete;
+
+    inline ~ExecutionSectionRingReader() noexcept { close(); }
+
+    /**
+     Maps an existing shared memory object created by ExecutionSectionRing.
+
+     \param[in] name the name of the shared memory object
+     \returns whether the shared memory object was successfully mapped
+    */
+    bool open(const std::string & name);
+
+    /** Unmaps the shared memory object, if open. */
+    void close() noexcept;
+
+    inline bool isOpen() const noexcept { return m_header; }
+
+    /**
+     Consumes the oldest published record, if any.
+
+     \param[out] record where to store the consumed record
+     \returns whether a record was consumed.
+    */
+    bool pop(ExecutionSectionRingRecord & record) noexcept;
+
+    /**
+     \param[in] nameIndex the name index of a consumed record
+     \returns the name with the given index, or nullptr if unknown.
+    */
+    const char * name(std::uint32_t nameIndex) const noexcept;
+
+    /** \returns the number of records dropped by the producer so far. */
+    std::uint64_t droppedRecords() const noexcept;
+
+private: /* Fields: */
+
+    const LogHard::Logger m_logger;
+
+    void * m_memory = nullptr;
+    std::size_t m_size = 0u;
+    const ExecutionSectionRingHeader * m_header = nullptr;
+    const char * m_names = nullptr;
+    const ExecutionSectionRingRecord * m_records = nullptr;
+
+};
+
+} /* namespace sharemind { */
+
+#endif /* SHAREMIND_EXECUTIONSECTIONRING_H */